@@ -57,18 +57,20 @@ std::string hex(const void* data, size_t size)
     return ret;
 }
 
-std::string md5hex(const std::string& str)
+std::string md5hex(const void* data, size_t size)
 {
     unsigned char md5[MD5_DIGEST_LENGTH];
     MD5_CTX ctx;
     
     MD5_Init(&ctx);
-    MD5_Update(&ctx, str.data(), str.size());
+    MD5_Update(&ctx, data, size);
     MD5_Final(md5, &ctx);
     
     return hex(md5, MD5_DIGEST_LENGTH);
 }
 
+std::string md5hex(const std::string& str) { return md5hex(str.data(), str.size()); }
+
 std::string makeDigest(const std::string& user, const std::string& passwd) {
     return md5hex(user + ":mongo:" + passwd);
 }
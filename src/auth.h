@@ -49,6 +49,11 @@ std::string makeAuthKey(const std::string& nonce, const std::string& user, const
 
 std::string mknonce();
 
+std::string hex(const void* data, size_t size);
+
+std::string md5hex(const void* data, size_t size);
+std::string md5hex(const std::string& str);
+
 
 
 enum class Privilege {
@@ -36,6 +36,9 @@
 #include "utility.h"
 #include <bson/bson11.h>
 #include <cassert>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
 
 Connection::~Connection()
 {
@@ -43,30 +46,58 @@ Connection::~Connection()
         DEBUG(3) << "Closing connection to " << endpoint().addr();
 }
 
+namespace {
+
+static const uint32_t AUTH_REQ_ID = 0x48545541; // "AUTH"
+static const uint32_t SETV_REQ_ID = 0x56544553; // "SETV"
+
+bool cmdOk(const bson::Object& ret)
+{
+    bson::Element ok = ret["ok"];
+    return ok.exists() && ok.canBe<int>() && ok.as<int>() == 1;
+}
+
+/// Returns true if the message is a plain query, so it can be sent before learning
+/// whether preceding authentication and setShardVersion have succeeded (a failure
+/// causes its reply to be discarded and the cursor it has opened to be killed).
+/// Writes (including write commands) cannot: they would take effect under a wrong
+/// shard version. Neither can OP_GET_MORE: a discarded batch would be lost.
+bool isPipelinable(const char* msg, size_t len)
+{
+    static const size_t OPCODE_OFFSET = 12, NS_OFFSET = 20;
+    if (len <= NS_OFFSET)
+        return false;
+    
+    Opcode op = *reinterpret_cast<const Opcode*>(msg + OPCODE_OFFSET);
+    if (op != Opcode::QUERY)
+        return false;
+    
+    const char* ns = msg + NS_OFFSET;
+    const char* nsEnd = std::find(ns, msg + len, '\0');
+    static const char CMD[] = ".$cmd";
+    static const size_t CMDLEN = sizeof(CMD) - 1;
+    return nsEnd != msg + len && !(nsEnd - ns >= (ssize_t) CMDLEN && !memcmp(nsEnd - CMDLEN, CMD, CMDLEN));
+}
+
+uint32_t msgID(const char* msg) { return *reinterpret_cast<const uint32_t*>(msg + sizeof(uint32_t)); }
+
+} // namespace
+
 void Connection::establish(const Namespace& ns, const ChunkVersion& v, const char* msg, size_t msglen)
 {
     assert(exists());
 
     if (stream().rdbuf()) {
-        authenticate();
-        if (impl_->isPrimary && !ns.empty() && v.stamp() != bson::Timestamp())
-            trySetVersion(ns, v);
-        
-        stream().write(msg, msglen).flush();
-        if (stream())
+        if (handshake(ns, v, msg, msglen))
             return;
-        
         endpoint().flush();
     }
     
     impl_->versions.clear();
-    stream() = io::stream(io::connect(endpoint().addr()));
-    authenticate();
-    if (impl_->isPrimary && !ns.empty() && v.stamp() != bson::Timestamp())
-        trySetVersion(ns, v);
-    stream().write(msg, msglen).flush();
+    impl_->authenticated = false;
+    stream() = endpoint().connect();
     
-    if (!stream()) {
+    if (!handshake(ns, v, msg, msglen)) {
         throw io::error(
             "cannot communicate with " + backend().addr()
             + " (" + toString(endpoint().addr()) + ")"
@@ -74,6 +105,69 @@ void Connection::establish(const Namespace& ns, const ChunkVersion& v, const cha
     }
 }
 
+bool Connection::handshake(const Namespace& ns, const ChunkVersion& v, const char* msg, size_t msglen)
+{
+    bool pipeline = isPipelinable(msg, msglen);
+    
+    for (unsigned attempt = 0; attempt != 2; ++attempt) {
+        
+        bool needAuth = !impl_->authenticated && !auth::sharedSecret().empty();
+        bool needVersion = impl_->isPrimary && !ns.empty() && v.stamp() != bson::Timestamp()
+            && (!ns.id() || impl_->versions[ns.id()] != v);
+        
+        std::string nonce;
+        if (needAuth) {
+            DEBUG(1) << "Authenticating in " << endpoint().addr();
+            nonce = getNonce();
+            if (!stream())
+                return false;
+            stream() << authCommand(nonce).msgID(AUTH_REQ_ID);
+        }
+        if (needVersion) {
+            DEBUG(1) << "Updating shard version for " << ns << " on " << endpoint().addr() << " to " << v;
+            stream() << setVersionCommand(ns, v).msgID(SETV_REQ_ID);
+        }
+        
+        bool sent = pipeline || (!needAuth && !needVersion);
+        if (sent)
+            stream().write(msg, msglen);
+        stream().flush();
+        if (!stream())
+            return false;
+        
+        if (needAuth)
+            checkAuthReply(readReply(stream(), AUTH_REQ_ID));
+        
+        if (needVersion && !checkSetVersionReply(ns, v, readReply(stream(), SETV_REQ_ID)) && attempt == 0) {
+            if (sent) {
+                // Discard reply to the message sent along, it will be sent once again.
+                // The cursor it may have opened is of no use; kill it (OP_KILL_CURSORS has no reply).
+                uint64_t cursorID = 0;
+                try {
+                    cursorID = readReply(stream(), msgID(msg), [](bson::Object) {});
+                }
+                catch (errors::BackendClientError&) {}
+                if (cursorID) {
+                    MsgBuilder b;
+                    b << (uint32_t) 0 << (uint32_t) 0 << Opcode::KILL_CURSORS
+                      << (uint32_t) 0 << (uint32_t) 1 << cursorID;
+                    stream().write(b.data(), b.size());
+                }
+            }
+            continue;
+        }
+        
+        if (!sent) {
+            stream().write(msg, msglen).flush();
+            if (!stream())
+                return false;
+        }
+        return true;
+    }
+    
+    return true; // not reached
+}
+
 void Connection::stepDown(std::chrono::seconds duration)
 {
     stream() << QueryComposer(Namespace("admin", "$cmd"), bson::object(
@@ -83,140 +177,675 @@ void Connection::stepDown(std::chrono::seconds duration)
     readReply(stream(), 0);
 }
 
-void Connection::authenticate()
+std::string Connection::getNonce()
 {
-    auto cmdOk = [](const bson::Object& ret) -> bool {
-        bson::Element ok = ret["ok"];
-        return ok.exists() && ok.canBe<int>() && ok.as<int>() == 1;
-    };
-    
-    if (impl_->authenticated || auth::sharedSecret().empty())
-        return;
-    
-    DEBUG(1) << "Authenticating in " << endpoint().addr();
-    
     stream() << QueryComposer(Namespace("local", "$cmd"), bson::object("getnonce", 1)).batchSize(1) << std::flush;
     if (!stream())
-        return; // establish() will take care of error handling
+        return std::string(); // establish() will take care of error handling
     
     bson::Object ret = readReply(stream(), 0);
     DEBUG(3) << "Received nonce: " << ret;
     if (!cmdOk(ret))
         throw errors::BackendInternalError(backend().addr(), ret["err"].as<std::string>("unknown error"));
     
-    std::string nonce = ret["nonce"].as<std::string>();
-    
-    stream() << QueryComposer(Namespace("local", "$cmd"), bson::object(
+    return ret["nonce"].as<std::string>();
+}
+
+QueryComposer Connection::authCommand(const std::string& nonce)
+{
+    return QueryComposer(Namespace("local", "$cmd"), bson::object(
         "authenticate", 1,
         "user", "__system",
         "nonce", nonce,
         "key", auth::makeAuthKey(nonce, "__system", auth::sharedSecret())
-    )).batchSize(1) << std::flush;
-    ret = readReply(stream(), 0);
+    )).batchSize(1);
+}
+
+void Connection::checkAuthReply(const bson::Object& ret)
+{
     DEBUG(3) << "Received reply: " << ret;
-    
     if (!cmdOk(ret))
         throw errors::BackendInternalError(backend().addr(), ret["errmsg"].as<std::string>("unknown error"));
     
     impl_->authenticated = true;
 }
 
-void Connection::trySetVersion(const Namespace& ns, const ChunkVersion& v)
+void Connection::authenticate()
 {
-    assert(exists());
-    ChunkVersion& current = impl_->versions[ns.ns()];
-    if (current == v)
+    if (impl_->authenticated || auth::sharedSecret().empty())
         return;
     
-    DEBUG(1) << "Updating shard version for " << ns << " on " << endpoint().addr()
-             << " to " << v;
+    DEBUG(1) << "Authenticating in " << endpoint().addr();
     
-    for (unsigned attempt = 0; attempt != 2; ++attempt) {
+    std::string nonce = getNonce();
+    if (!stream())
+        return;
     
-        static const uint32_t reqID = 0x56544553; // "SETV"
-        bson::ObjectBuilder b;
-        b["setShardVersion"] = ns.ns();
-        b["configdb"] = g_config->connectionString();
-        b["version"] = v.stamp();
-        b["versionEpoch"] = v.epoch();
-        if (backend().softwareVersion() < Backend::SoftwareVersion { 3, 0 })
-            b["serverID"] = serverID();
-        b["shard"] = backend().shard()->id();
-        b["shardHost"] = backend().shard()->connectionString();
-        b["authoritative"] = true;
-        
-        stream() << QueryComposer(Namespace("admin", "$cmd"), b.obj()).msgID(reqID).batchSize(1) << std::flush;
-        if (!stream())
-            return;
+    stream() << authCommand(nonce).msgID(AUTH_REQ_ID) << std::flush;
+    if (!stream())
+        return;
+    checkAuthReply(readReply(stream(), AUTH_REQ_ID));
+}
 
-        bson::Object ret = readReply(stream(), reqID);
-        if (ret["ok"].as<int>()) {
-            current = v;
-            return;
-        }
-        std::string errmsg = ret["errmsg"].as<std::string>();
-        if (errmsg == "not master") {
-            throw errors::NotMaster();
-        } else if (errmsg.find(":: 8002 all servers down") != std::string::npos) {
-            DEBUG(1) << "mongod went crazy, will retry";
-            continue;
-        } else if (errmsg.find("sharding metadata manager failed to initialize") != std::string::npos) {
-            ERROR() << backend().addr() << " permanently incapable of operating as master";
-            backend().permanentlyFailed(errmsg);
-            stepDown(3600_s);
-            throw errors::PermanentFailure(backend().addr(), errmsg);
-        } else if (errmsg.find("None of the hosts for replica set") != std::string::npos) {
-            throw errors::ConnectivityError(backend().addr(), errmsg);
-        } else {
-            throw errors::ShardConfigStale(backend().addr(), errmsg);
-        }
+QueryComposer Connection::setVersionCommand(const Namespace& ns, const ChunkVersion& v)
+{
+    bson::ObjectBuilder b;
+    b["setShardVersion"] = ns.ns();
+    b["configdb"] = g_config->connectionString();
+    b["version"] = v.stamp();
+    b["versionEpoch"] = v.epoch();
+    if (backend().softwareVersion() < Backend::SoftwareVersion { 3, 0 })
+        b["serverID"] = serverID();
+    b["shard"] = backend().shard()->id();
+    b["shardHost"] = backend().shard()->connectionString();
+    b["authoritative"] = true;
+    
+    return QueryComposer(Namespace("admin", "$cmd"), b.obj()).batchSize(1);
+}
+
+bool Connection::checkSetVersionReply(const Namespace& ns, const ChunkVersion& v, const bson::Object& ret)
+{
+    if (ret["ok"].as<int>()) {
+        if (ns.id())
+            impl_->versions[ns.id()] = v;
+        return true;
+    }
+    
+    std::string errmsg = ret["errmsg"].as<std::string>();
+    if (errmsg == "not master") {
+        throw errors::NotMaster();
+    } else if (errmsg.find(":: 8002 all servers down") != std::string::npos) {
+        DEBUG(1) << "mongod went crazy, will retry";
+        return false;
+    } else if (errmsg.find("sharding metadata manager failed to initialize") != std::string::npos) {
+        ERROR() << backend().addr() << " permanently incapable of operating as master";
+        backend().permanentlyFailed(errmsg);
+        stepDown(3600_s);
+        throw errors::PermanentFailure(backend().addr(), errmsg);
+    } else if (errmsg.find("None of the hosts for replica set") != std::string::npos) {
+        throw errors::ConnectivityError(backend().addr(), errmsg);
+    } else {
+        throw errors::ShardConfigStale(backend().addr(), errmsg);
     }
 }
 
 
-Connection Endpoint::pop(std::vector<Connection>& v)
+Connection::Impl::Impl(Endpoint* ept, bool primary):
+    endpt(ept), anchor(ept ? ept->anchor_ : nullptr), isPrimary(primary)
+{}
+
+Connection::Impl::~Impl()
 {
+    if (!anchor)
+        return;
+    std::unique_lock<io::sys::mutex> lock(anchor->mutex);
+    if (anchor->endpt)
+        anchor->endpt->closed();
+}
+
+
+Endpoint::~Endpoint()
+{
+    // Connections still held by requests may be closed after the endpoint is gone
+    std::unique_lock<io::sys::mutex> lock(anchor_->mutex);
+    anchor_->endpt = nullptr;
+}
+
+
+struct Endpoint::Waiter {
+    explicit Waiter(bool primary): primary(primary) {}
+    
+    bool primary;
+    io::mutex mutex;
+    io::condition_variable cond;
+    bool granted = false; // either `conn' or a permission to open a new connection
+    Connection conn;
+};
+
+size_t Endpoint::idleLimit() const
+{
+    return std::min(options().connPoolMax, std::max(options().connPoolSize, stats_.target));
+}
+
+bool Endpoint::isUsable(const Connection& c, SteadyClock::time_point now)
+{
+    if (now - c.impl_->idleSince > options().connIdleTimeout)
+        return false;
+    
+    const io::stream& s = c.impl_->s;
+    if (!s.rdbuf())
+        return true; // not connected yet
+    if (!s || s.rdbuf()->in_avail() > 0)
+        return false; // broken, or has leftovers from a previous exchange
+    
+    const io::fd* fd = s.fd();
+    if (!fd)
+        return true;
+    
+    // Anything to read on an idle connection means either EOF or garbage
+    char ch;
+    ssize_t n = ::recv(fd->get(), &ch, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+}
+
+Connection Endpoint::takeIdle(std::vector<Connection>& v)
+{
+    bool primary = (&v == &primaries_);
     std::unique_lock<io::sys::mutex> lock(mutex_);
-    if (v.empty())
-        return {};
-    Connection ret = std::move(v.back());
-    v.pop_back();
+    
+    // Connections which have never been given a shard version can be used as primary ones.
+    std::vector<Connection>* src = !v.empty() ? &v : (primary && !conns_.empty()) ? &conns_ : nullptr;
+    if (!src)
+        return Connection();
+    
+    Connection ret = std::move(src->back());
+    src->pop_back();
+    ret.impl_->isPrimary = primary;
+    --stats_.idle;
+    inUseChanged();
     return ret;
 }
 
-Connection Endpoint::get(std::vector<Connection>& v)
+Connection Endpoint::get(std::vector<Connection>& v, bool wait)
 {
-    Connection ret = pop(v);
-    if (ret.exists()) {
-        DEBUG(1) << "Using existing connection for " << addr_;
-        return ret;
+    bool primary = (&v == &primaries_);
+    std::shared_ptr<Waiter> w;
+    Connection excess;
+    
+    for (;;) {
+        Connection c = takeIdle(v);
+        if (!c.exists())
+            break;
+        if (isUsable(c, SteadyClock::now())) {
+            DEBUG(1) << "Using existing connection for " << addr_;
+            std::unique_lock<io::sys::mutex> lock(mutex_);
+            ++stats_.reused;
+            return c;
+        }
+        DEBUG(1) << "Discarding stale connection to " << addr_;
+        {
+            std::unique_lock<io::sys::mutex> lock(mutex_);
+            ++stats_.reaped;
+        }
+        // `c' is closed here, with the lock released
+    }
+    
+    {
+        std::unique_lock<io::sys::mutex> lock(mutex_);
+        
+        if (stats_.open < options().connPoolMax && waiters_.empty()) {
+            DEBUG(1) << "Creating new connection for " << addr_;
+            ++stats_.open;
+            ++stats_.created;
+            inUseChanged();
+            return Connection(this, primary);
+        }
+        
+        if (!wait) {
+            DEBUG(1) << "Connection pool for " << addr_ << " exhausted";
+            return Connection();
+        }
+        
+        DEBUG(1) << "Connection pool for " << addr_ << " exhausted; waiting";
+        w = std::make_shared<Waiter>(primary);
+        waiters_.push_back(w);
+        ++stats_.waits;
+        
+        // Idle connections of the other kind are of no use to us; closing one frees a slot.
+        if (!primaries_.empty()) {
+            excess = std::move(primaries_.back());
+            primaries_.pop_back();
+            --stats_.idle;
+            inUseChanged();
+        }
+    }
+    
+    excess = Connection();
+    
+    SteadyClock::time_point started = SteadyClock::now();
+    std::unique_lock<io::mutex> wlock(w->mutex);
+    if (!w->cond.wait_for(wlock, options().connWaitTimeout, [&w]{ return w->granted; })) {
+        bool withdrawn = false;
+        {
+            std::unique_lock<io::sys::mutex> lock(mutex_);
+            auto i = std::find(waiters_.begin(), waiters_.end(), w);
+            if (i != waiters_.end()) {
+                waiters_.erase(i);
+                ++stats_.waitTimeouts;
+                stats_.waitTime += std::chrono::duration_cast<std::chrono::microseconds>(SteadyClock::now() - started);
+                withdrawn = true;
+            }
+        }
+        if (withdrawn)
+            throw errors::NoSuitableBackend("timeout while waiting for a connection to " + backend_->addr());
+        
+        // Someone is handing a connection to us right now
+        w->cond.wait(wlock, [&w]{ return w->granted; });
+    }
+    
+    {
+        std::unique_lock<io::sys::mutex> lock(mutex_);
+        stats_.waitTime += std::chrono::duration_cast<std::chrono::microseconds>(SteadyClock::now() - started);
+        inUseChanged();
+    }
+    
+    if (w->conn.exists()) {
+        w->conn.impl_->isPrimary = primary;
+        return std::move(w->conn);
     } else {
         DEBUG(1) << "Creating new connection for " << addr_;
-        return Connection(this, &v == &primaries_);
+        return Connection(this, primary);
+    }
+}
+
+void Endpoint::grant(const std::shared_ptr<Waiter>& w, Connection c)
+{
+    std::unique_lock<io::mutex> lock(w->mutex);
+    w->conn = std::move(c);
+    w->granted = true;
+    w->cond.notify_one();
+}
+
+void Endpoint::closed()
+{
+    std::shared_ptr<Waiter> w;
+    {
+        std::unique_lock<io::sys::mutex> lock(mutex_);
+        --stats_.open;
+        if (!waiters_.empty()) {
+            w = std::move(waiters_.front());
+            waiters_.pop_front();
+            ++stats_.open;
+            ++stats_.created;
+        }
+        inUseChanged();
     }
+    if (w)
+        grant(w, Connection());
 }
 
 void Endpoint::flush()
 {
     DEBUG(1) << "Flushing all connections for " << addr_;
-    std::unique_lock<io::sys::mutex> lock(mutex_);
-    conns_.clear();
-    primaries_.clear();
+    std::vector<Connection> conns, primaries;
+    {
+        std::unique_lock<io::sys::mutex> lock(mutex_);
+        std::swap(conns, conns_);
+        std::swap(primaries, primaries_);
+        stats_.idle = 0;
+        inUseChanged();
+    }
+    pipe_.reset();
+    // Connections are closed here, with the lock released
 }
 
-void Endpoint::release(Connection&& conn)
+void Endpoint::release(Connection&& released)
 {
-    if (!conn.exists())
+    if (!released.exists())
         return;
+    
+    // Whatever is not stashed or handed over is closed upon return, with the lock released
+    Connection conn = std::move(released);
+    std::shared_ptr<Waiter> w;
+    {
+        std::unique_lock<io::sys::mutex> lock(mutex_);
+        if (!waiters_.empty()) {
+            // A connection with a shard version set cannot be used as a non-primary one;
+            // otherwise hand it over to the first waiter it suits. If none, closing it
+            // will let the first waiter open a new one.
+            auto i = std::find_if(waiters_.begin(), waiters_.end(),
+                [&conn](const std::shared_ptr<Waiter>& x) { return x->primary || !conn.impl_->isPrimary; });
+            if (i != waiters_.end()) {
+                w = std::move(*i);
+                waiters_.erase(i);
+            }
+        } else {
+            std::vector<Connection>* v = (conn.impl_->isPrimary ? &primaries_ : &conns_);
+            if (v->size() < idleLimit()) {
+                DEBUG(3) << "Stashing connection to " << conn.endpoint().addr();
+                conn.impl_->idleSince = SteadyClock::now();
+                v->push_back(std::move(conn));
+                ++stats_.idle;
+                inUseChanged();
+                return;
+            } else {
+                DEBUG(3) << "Not stashing connection to " << conn.endpoint().addr() << ": connection pool full";
+            }
+        }
+    }
+    
+    if (w) {
+        DEBUG(3) << "Handing connection to " << conn.endpoint().addr() << " over to a waiting request";
+        grant(w, std::move(conn));
+    }
+}
+
+void Endpoint::inUseChanged()
+{
+    size_t inUse = stats_.open - stats_.idle;
+    inFlight_.store(inUse, std::memory_order_relaxed);
+    peakInUse_ = std::max(peakInUse_, inUse);
+}
+
+void Endpoint::requestCompleted(std::chrono::microseconds latency)
+{
+    latency_.add(latency);
+    updateExpectedRoundtrip();
+    backend_->endpointSlowedDown(this);
+    if (backend_->shard_)
+        backend_->shard_->succeeded(backend_);
+}
+
+void Endpoint::updateExpectedRoundtrip()
+{
+    std::chrono::microseconds rt = roundtrip();
+    if (rt != std::chrono::microseconds::max() && latency_.hasSamplesSince(SteadyClock::now() - options().pingInterval))
+        rt = std::max(rt, latency_.average());
+    expectedRoundtrip_.store(rt, std::memory_order_relaxed);
+}
 
-    std::vector<Connection>* v = (conn.impl_->isPrimary ? &primaries_ : &conns_);
+Endpoint::PoolStats Endpoint::poolStats() const
+{
     std::unique_lock<io::sys::mutex> lock(mutex_);
-    if (v->size() < options().connPoolSize) {
-        DEBUG(3) << "Stashing connection to " << conn.endpoint().addr();
-        v->push_back(std::move(conn));
-    } else {
-        DEBUG(3) << "Not stashing connection to " << conn.endpoint().addr() << ": connection pool full";
+    PoolStats ret = stats_;
+    ret.waiting = waiters_.size();
+    ret.connecting = connecting_;
+    ret.throttled = throttled_;
+    return ret;
+}
+
+io::stream Endpoint::connect(bool urgent)
+{
+    if (urgent)
+        return io::stream(io::connect(addr_));
+    
+    std::chrono::microseconds delay { 0 };
+    {
+        std::unique_lock<io::mutex> lock(connectMutex_);
+        size_t max = std::max<size_t>(options().connectConcurrency, 1);
+        
+        if (connecting_ >= max) {
+            if (connectQueue_ >= options().connectQueue) {
+                ++throttled_;
+                throw errors::Throttled("too many connections to " + backend_->addr() + " being established");
+            }
+            ++connectQueue_;
+            bool ok = connectCond_.wait_for(lock, options().connWaitTimeout, [this, max]{ return connecting_ < max; });
+            --connectQueue_;
+            if (!ok) {
+                ++throttled_;
+                throw errors::Throttled("timeout while waiting to connect to " + backend_->addr());
+            }
+        }
+        ++connecting_;
+        
+        // Generic cell rate algorithm: allows bursts of `max' connections,
+        // then paces them at `--connect-rate', with a random jitter.
+        if (options().connectRate) {
+            std::chrono::microseconds interval(std::max<uint64_t>(1000000 / options().connectRate, 1));
+            SteadyClock::time_point now = SteadyClock::now();
+            connectTat_ = std::max(connectTat_, now) + interval;
+            SteadyClock::time_point at = connectTat_ - interval * max;
+            if (at > now) {
+                delay = std::chrono::duration_cast<std::chrono::microseconds>(at - now)
+                    + std::chrono::microseconds(randomIndex(interval.count() + 1));
+            }
+        }
+    }
+    
+    // Release the slot upon return, exception or cancellation
+    std::shared_ptr<void> guard(nullptr, [this](void*) {
+        std::unique_lock<io::mutex> lock(connectMutex_);
+        --connecting_;
+        connectCond_.notify_one();
+    });
+    
+    if (delay.count()) {
+        DEBUG(2) << "Delaying connection to " << addr_ << " for " << delay.count() << " us";
+        io::sleep(delay);
+    }
+    return io::stream(io::connect(addr_));
+}
+
+void Endpoint::maintainPool()
+{
+    std::vector<Connection> excess;
+    size_t missing = 0;
+    {
+        std::unique_lock<io::sys::mutex> lock(mutex_);
+        stats_.target = peakInUse_;
+        peakInUse_ = stats_.open - stats_.idle;
+        
+        size_t limit = idleLimit();
+        for (std::vector<Connection>* v: { &conns_, &primaries_ }) {
+            while (v->size() > limit) {
+                excess.push_back(std::move(v->back()));
+                v->pop_back();
+                --stats_.idle;
+            }
+        }
+        
+        size_t min = std::min(options().connPoolMin, options().connPoolMax);
+        if (stats_.open < min && waiters_.empty()) {
+            missing = min - stats_.open;
+            stats_.open += missing;
+            stats_.created += missing;
+        }
+        inUseChanged();
+    }
+    
+    if (!excess.empty())
+        DEBUG(2) << "Closing " << excess.size() << " excess connections to " << addr_;
+    excess.clear();
+    
+    std::vector<Connection> conns;
+    for (; missing; --missing)
+        conns.emplace_back(this, false);
+    
+    if (!conns.empty())
+        DEBUG(1) << "Opening " << conns.size() << " connections to " << addr_;
+    
+    io::for_each(conns.begin(), conns.end(), [this](Connection& c) {
+        try {
+            c.stream() = connect();
+            c.authenticate();
+            if (c.stream())
+                release(std::move(c));
+        }
+        catch (std::exception& e) {
+            DEBUG(1) << "Cannot open connection to " << addr_ << ": " << e.what();
+        }
+    });
+}
+
+struct PipelinedConnection::Request {
+    io::mutex mutex;
+    io::condition_variable cond;
+    bool done = false;
+    bson::Object reply;
+    std::string errmsg;
+    std::shared_ptr<Session> session; // the request has been sent over; guarded by `PipelinedConnection::mutex_'
+};
+
+std::vector<bson::Object> PipelinedConnection::roundtrip(std::vector<QueryComposer> queries)
+{
+    std::vector<uint32_t> ids;
+    std::vector< std::shared_ptr<Request> > reqs;
+    std::vector<char> data;
+    for (QueryComposer& q: queries) {
+        ids.push_back(++lastReqID_);
+        reqs.push_back(std::make_shared<Request>());
+        std::vector<char> msg = q.msgID(ids.back()).data();
+        data.insert(data.end(), msg.begin(), msg.end());
+    }
+    
+    {
+        std::unique_lock<io::sys::mutex> lock(mutex_);
+        for (size_t i = 0; i != ids.size(); ++i)
+            pending_.insert(std::make_pair(ids[i], reqs[i]));
+    }
+    
+    // Forget requests upon return, exception or cancellation
+    std::shared_ptr<void> guard(nullptr, [this, &ids](void*) {
+        std::unique_lock<io::sys::mutex> lock(mutex_);
+        for (uint32_t id: ids)
+            pending_.erase(id);
+    });
+    
+    write(data, reqs);
+    
+    std::vector<bson::Object> ret;
+    for (const std::shared_ptr<Request>& r: reqs) {
+        std::unique_lock<io::mutex> lock(r->mutex);
+        r->cond.wait(lock, [&r]{ return r->done; });
+        if (!r->errmsg.empty())
+            throw errors::BackendInternalError(endpt_->backend().addr(), r->errmsg);
+        ret.push_back(std::move(r->reply));
     }
+    return ret;
+}
+
+void PipelinedConnection::send(const std::vector<char>& msg)
+{
+    write(msg, {});
+}
+
+void PipelinedConnection::write(const std::vector<char>& data, const std::vector< std::shared_ptr<Request> >& reqs)
+{
+    std::unique_lock<io::mutex> lock(writeMutex_);
+    
+    for (unsigned attempt = 0; attempt != 2; ++attempt) {
+        bool reset = resetRequested_.exchange(false);
+        if (session_ && (reset || session_->closed)) {
+            // Replies to requests sent over the old stream will never arrive
+            reader_ = io::task<void>();
+            failAll(session_, reset ? "connection reset" : "connection closed");
+            session_.reset();
+        }
+        
+        bool fresh = false;
+        if (!session_) {
+            std::shared_ptr<Session> session = std::make_shared<Session>();
+            // Long-living and shared by many requests, this connection is not
+            // counted as one in use (see Endpoint::inFlight()).
+            session->conn = Connection(endpt_, false);
+            session->conn.impl_->anchor.reset();
+            session->conn.stream() = endpt_->connect(true);
+            fresh = true;
+            session->conn.authenticate();
+            if (!session->conn.stream())
+                break;
+            
+            session_ = session;
+            reader_ = io::spawn([this](std::shared_ptr<Session> s) { readReplies(s); }, session);
+        }
+        
+        auto mark = [this, &reqs](const std::shared_ptr<Session>& s) {
+            std::unique_lock<io::sys::mutex> lock(mutex_);
+            for (const std::shared_ptr<Request>& r: reqs)
+                r->session = s;
+        };
+        
+        // Reader uses the same stream concurrently, so stream state flags
+        // must not be touched; talk to its buffer directly.
+        mark(session_);
+        std::streambuf* buf = session_->conn.stream().rdbuf();
+        if (buf->sputn(data.data(), data.size()) == (std::streamsize) data.size() && buf->pubsync() == 0)
+            return;
+        
+        DEBUG(1) << "Pipelined connection to " << endpt_->addr() << " broken";
+        mark(nullptr); // ours are to be sent once again
+        reader_ = io::task<void>();
+        failAll(session_, "connection broken");
+        session_.reset();
+        if (fresh)
+            break;
+    }
+    
+    throw io::error(
+        "cannot communicate with " + endpt_->backend().addr()
+        + " (" + toString(endpt_->addr()) + ")"
+    );
+}
+
+void PipelinedConnection::readReplies(std::shared_ptr<Session> session)
+{
+    std::streambuf* buf = session->conn.stream().rdbuf();
+    std::string errmsg;
+    try {
+        for (;;) {
+            uint32_t len;
+            if (buf->sgetn(reinterpret_cast<char*>(&len), sizeof(len)) != sizeof(len))
+                throw errors::BackendInternalError("connection closed");
+            if (len > 16*1024*1024 || len < sizeof(len) + 4 * sizeof(uint32_t) + sizeof(uint64_t) + 2 * sizeof(uint32_t))
+                throw errors::BackendInternalError("malformed reply");
+            
+            std::vector<char> data(len - sizeof(len));
+            if (buf->sgetn(data.data(), data.size()) != (std::streamsize) data.size())
+                throw errors::BackendInternalError("connection closed");
+            
+            Message msg(std::move(data));
+            uint32_t flags, startingFrom, numberReturned;
+            uint64_t cursorID;
+            bson::Object obj;
+            msg.fetch(flags).fetch(cursorID).fetch(startingFrom).fetch(numberReturned);
+            if (numberReturned)
+                msg.fetch(obj);
+            
+            complete(msg.responseTo(), obj,
+                (flags & 0x02) ? obj["$err"].as<std::string>("query failure") : std::string());
+        }
+    }
+    catch (std::exception& e) {
+        errmsg = e.what();
+    }
+    
+    DEBUG(1) << "Pipelined connection to " << endpt_->addr() << " closed: " << errmsg;
+    session->closed = true;
+    failAll(session, errmsg);
+}
+
+void PipelinedConnection::complete(uint32_t reqID, bson::Object reply, std::string errmsg)
+{
+    std::shared_ptr<Request> r;
+    {
+        std::unique_lock<io::sys::mutex> lock(mutex_);
+        auto i = pending_.find(reqID);
+        if (i == pending_.end())
+            return; // requester gave up
+        r = std::move(i->second);
+        pending_.erase(i);
+    }
+    
+    finish(r, std::move(reply), std::move(errmsg));
+}
+
+void PipelinedConnection::finish(const std::shared_ptr<Request>& r, bson::Object reply, std::string errmsg)
+{
+    std::unique_lock<io::mutex> lock(r->mutex);
+    r->reply = std::move(reply);
+    r->errmsg = std::move(errmsg);
+    r->done = true;
+    r->cond.notify_one();
+}
+
+void PipelinedConnection::failAll(const std::shared_ptr<Session>& session, const std::string& errmsg)
+{
+    // Requests not sent yet will go over a new session
+    std::vector< std::shared_ptr<Request> > failed;
+    {
+        std::unique_lock<io::sys::mutex> lock(mutex_);
+        for (auto i = pending_.begin(); i != pending_.end();) {
+            if (i->second->session == session) {
+                failed.push_back(std::move(i->second));
+                i = pending_.erase(i);
+            } else {
+                ++i;
+            }
+        }
+    }
+    for (const std::shared_ptr<Request>& r: failed)
+        finish(r, bson::Object(), errmsg.empty() ? "connection closed" : errmsg);
 }
 
 void Endpoint::setAlive(
@@ -228,9 +857,12 @@ void Endpoint::setAlive(
         << std::chrono::duration_cast<std::chrono::milliseconds>(netRoundtrip).count() << " ms net, "
         << std::chrono::duration_cast<std::chrono::milliseconds>(grossRoundtrip).count() << " ms gross)";
     
+    if (pinged_ && !alive())
+        unsettle();
     pinged_ = true;
-    prevRoundtrip_ = roundtrip_;
+    prevRoundtrip_ = roundtrip_.load();
     roundtrip_ = netRoundtrip;
+    updateExpectedRoundtrip();
     backend_->endpointAlive(this, std::move(obj));
 }
 
@@ -238,9 +870,17 @@ void Endpoint::setDead(const std::string& reason)
 {
     LogMessage(!pinged_ || alive() ? LogMessage::NOTICE : 3) << backend_->addr() << " at " << addr_ << " dead: " << reason;
     
+    if (pinged_ && alive())
+        unsettle();
+    {
+        // Fetch full status once the endpoint is back
+        std::unique_lock<io::sys::mutex> lock(mutex_);
+        fingerprint_.clear();
+    }
     pinged_ = true;
-    prevRoundtrip_ = roundtrip_;
+    prevRoundtrip_ = roundtrip_.load();
     roundtrip_ = std::chrono::microseconds::max();
+    updateExpectedRoundtrip();
     backend_->endpointDead(this);
     flush();
 }
@@ -248,44 +888,126 @@ void Endpoint::setDead(const std::string& reason)
 void Endpoint::failed()
 {
     DEBUG(1) << "Initiating ping of " << backend_->addr() << " at " << addr_ << " due to backend failure";
-    prevRoundtrip_ = roundtrip_;
+    prevRoundtrip_ = roundtrip_.load();
     roundtrip_ = std::chrono::microseconds::max();
+    updateExpectedRoundtrip();
     flush();
     io::spawn([this] { pingNow(); }).detach();
 }
 
-bool Endpoint::pingNow()
+namespace {
+
+/// Returns a digest of those fields of an `isMaster' reply which
+/// describe the server's role in its replica set, so that a full
+/// status refresh is only needed when the digest changes.
+std::string fingerprint(const bson::Object& isMaster)
+{
+    static const char* const KEYS[] = {
+        "ismaster", "secondary", "arbiterOnly", "hidden", "setName", "setVersion",
+        "electionId", "primary", "me", "hosts", "passives", "arbiters", "tags", "maxWireVersion"
+    };
+    
+    bson::ObjectBuilder b;
+    for (const char* key: KEYS) {
+        bson::Element elt = isMaster[key];
+        if (elt.exists())
+            b.put(key, elt);
+    }
+    bson::Object obj = b.obj();
+    return std::string(obj.rawData(), obj.rawSize());
+}
+
+unsigned pid(const bson::Object& status)
+{
+    bson::Element elt = status["server_status"]["pid"];
+    return elt.exists() && elt.canBe<unsigned>() ? elt.as<unsigned>() : 0;
+}
+
+} // namespace
+
+bool Endpoint::pingNow(bool full)
 {
-    static const uint32_t REQ_ID = 0x474E4950; // "PING"    
     std::vector<Shard::PingQuery> queries = (backend_->shard_ ? backend_->shard_->pingQueries() : std::vector<Shard::PingQuery>{});
-    queries.emplace_back(Shard::PingQuery { "build_info", Namespace("local", "$cmd"), bson::object("buildinfo", 1) });
-    queries.emplace_back(Shard::PingQuery { "server_status", Namespace("admin", "$cmd"), bson::object("serverStatus", 1) });
+    // Only sections needed for the pid and server load (see Backend::updateLoad())
+    // are requested, so that serverStatus is cheap enough to be sent on each ping.
+    Shard::PingQuery serverStatus { "server_status", Namespace("admin", "$cmd"), bson::object(
+        "serverStatus", 1, "asserts", 0, "connections", 0, "extra_info", 0, "locks", 0,
+        "metrics", 0, "network", 0, "opLatencies", 0, "repl", 0, "security", 0,
+        "storageEngine", 0, "tcmalloc", 0, "transactions", 0, "wiredTiger", 0
+    ) };
+    queries.push_back(serverStatus);
+    Shard::PingQuery buildInfo { "build_info", Namespace("local", "$cmd"), bson::object("buildinfo", 1) };
     
     DEBUG(1) << "Pinging " << backend_->addr() << " on " << addr_;
-    io::task<void> t = io::spawn([this, &queries]() {
+    io::task<void> t = io::spawn([this, &queries, &serverStatus, &buildInfo, full]() {
         SteadyClock::time_point started = SteadyClock::now();
         bson::ObjectBuilder status;
 
-        Connection c = getAny();
-        c.establish(Namespace(), ChunkVersion(),
-            QueryComposer(Namespace("local", "$cmd"), bson::object("ping", 1)).msgID(REQ_ID).batchSize(1).slaveOK());
-        readReply(c.stream(), REQ_ID, [this](const bson::Object& obj) {
-            if (obj["ok"].as<int>(0) != 1)
-                throw std::runtime_error("negative reply to ping command");
-        });
+        bson::Object isMaster = pipe_.roundtrip({
+            QueryComposer(Namespace("admin", "$cmd"), bson::object("isMaster", 1)).batchSize(1).slaveOK()
+        }).front();
+        if (isMaster["ok"].as<int>(0) != 1)
+            throw std::runtime_error("negative reply to isMaster command");
         
         SteadyClock::time_point firstResp = SteadyClock::now();
-
-        uint32_t reqID = REQ_ID;
-        for (const Shard::PingQuery& q: queries) {
-            c.stream() << QueryComposer(q.ns, q.criteria).msgID(++reqID).batchSize(1).slaveOK() << std::flush;
-            readReply(c.stream(), reqID, [&status, &q, this](const bson::Object& obj) {
-                status[q.key] = obj;
-            });
+        status["is_master"] = isMaster;
+        
+        std::string fp = fingerprint(isMaster);
+        bson::Object prev = backend_->status();
+        bool refresh = full || prev.empty();
+        {
+            std::unique_lock<io::sys::mutex> lock(mutex_);
+            if (fp != fingerprint_) {
+                if (!fingerprint_.empty())
+                    unsettle();
+                refresh = true;
+            }
+            if (firstResp >= statusFetchedAt_ + options().pingStatusInterval)
+                refresh = true;
+        }
+        
+        if (!refresh) {
+            // Server load changes much faster than the rest of the status,
+            // so it is refreshed on each ping.
+            status[serverStatus.key] = pipe_.roundtrip({
+                QueryComposer(serverStatus.ns, serverStatus.criteria).batchSize(1).slaveOK()
+            }).front();
+            for (const bson::Element& elt: prev)
+                if (elt.name() != std::string("is_master") && elt.name() != serverStatus.key)
+                    status.put(elt.name(), elt);
+            setAlive(firstResp - started, SteadyClock::now() - started, status.obj());
+            return;
+        }
+        
+        // Software version only changes on restart
+        bool needBuildInfo = prev["build_info"].as<bson::Object>(bson::Object()).empty();
+        if (needBuildInfo)
+            queries.push_back(buildInfo);
+        
+        std::vector<QueryComposer> composers;
+        for (const Shard::PingQuery& q: queries)
+            composers.push_back(QueryComposer(q.ns, q.criteria).batchSize(1).slaveOK());
+        std::vector<bson::Object> replies = pipe_.roundtrip(std::move(composers));
+        for (size_t i = 0; i != queries.size(); ++i)
+            status[queries[i].key] = replies[i];
+        
+        if (!needBuildInfo) {
+            bson::Object reply = replies[queries.size() - 1]; // server_status
+            if (pid(prev) != 0 && reply["pid"].as<unsigned>(0) != pid(prev)) {
+                status[buildInfo.key] = pipe_.roundtrip({
+                    QueryComposer(buildInfo.ns, buildInfo.criteria).batchSize(1).slaveOK()
+                }).front();
+            } else {
+                status.put(buildInfo.key, prev[buildInfo.key.c_str()]);
+            }
+        }
+        
+        {
+            std::unique_lock<io::sys::mutex> lock(mutex_);
+            fingerprint_ = fp;
+            statusFetchedAt_ = SteadyClock::now();
         }
-
         setAlive(firstResp - started, SteadyClock::now() - started, status.obj());
-        c.release();
     });
     io::wait(t, options().pingTimeout);
     
@@ -293,6 +1015,7 @@ bool Endpoint::pingNow()
         return true;
     
     if (!t.completed()) {
+        t = io::task<void>();
         setDead("timeout");
         return false;
     }
@@ -306,33 +1029,171 @@ bool Endpoint::pingNow()
     return false;
 }
 
-void Endpoint::keepPing()
+void Endpoint::reap()
+{
+    std::vector<Connection> stale;
+    {
+        std::unique_lock<io::sys::mutex> lock(mutex_);
+        SteadyClock::time_point now = SteadyClock::now();
+        for (std::vector<Connection>* v: { &conns_, &primaries_ }) {
+            auto i = std::stable_partition(v->begin(), v->end(),
+                [now](const Connection& c) { return !isUsable(c, now); });
+            std::move(v->begin(), i, std::back_inserter(stale));
+            v->erase(v->begin(), i);
+        }
+        stats_.idle -= stale.size();
+        stats_.reaped += stale.size();
+        inUseChanged();
+    }
+    
+    if (!stale.empty())
+        DEBUG(1) << "Closing " << stale.size() << " stale idle connections to " << addr_;
+    // Connections are closed here, with the lock released
+}
+
+void Endpoint::keepReaping()
 {
+    std::chrono::milliseconds interval = std::max<std::chrono::milliseconds>(
+        options().connIdleTimeout / 4, std::chrono::milliseconds(1000));
     for (;;) {
-        if (pingNow()) {
-            io::sleep(options().pingInterval);
+        io::sleep(interval);
+        reap();
+    }
+}
+
+void Endpoint::keepPing()
+{
+    // Pings of all endpoints (and of all mongoz instances, which tend
+    // to be restarted together) are spread over the interval, rather
+    // than coming in bursts.
+    auto jittered = [](std::chrono::milliseconds interval, size_t minPercent, size_t maxPercent) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(interval)
+            * static_cast<int64_t>(minPercent + randomIndex(maxPercent - minPercent + 1)) / 100;
+    };
+    
+    for (bool first = true;; first = false) {
+        std::chrono::milliseconds interval;
+        if (pingNow(false)) {
+            if (maintain_.completed())
+                maintain_ = io::spawn([this]{ maintainPool(); });
+            interval = options().pingInterval;
+            
+            bson::Object isMaster = backend_->status()["is_master"].as<bson::Object>(bson::Object());
+            bool watchDue;
+            {
+                std::unique_lock<io::sys::mutex> lock(mutex_);
+                watchDue = SteadyClock::now() >= watchRetryAt_;
+            }
+            if (
+                options().topologyAwait != std::chrono::milliseconds::zero() && watch_.completed() && watchDue
+                && isMaster["setName"].exists() && isMaster["topologyVersion"].exists()
+            ) {
+                watch_ = io::spawn([this]{ keepWatching(); });
+            }
         } else {
-            io::sleep(options().pingFailInterval);
+            interval = options().pingFailInterval;
         }
+        
+        // Shortly after a change (an election, a member going up or down)
+        // more changes are likely to follow, so watch closer for a while.
+        unsigned unsettled = unsettled_;
+        while (unsettled && !unsettled_.compare_exchange_weak(unsettled, unsettled - 1)) {}
+        if (unsettled)
+            interval = std::min(interval, options().pingFailInterval);
+        
+        io::sleep(first ? jittered(interval, 1, 100) : jittered(interval, 90, 110));
     }
 }
 
-void Backend::endpointAlive(Endpoint* pt, bson::Object status)
+void Endpoint::keepWatching()
 {
-    auto pid = [](const bson::Object& status) -> unsigned {
-        auto elt = status["pid"];
-        return elt.exists() && elt.canBe<unsigned>() ? elt.as<unsigned>() : 0;
-    };
+    DEBUG(1) << "Watching topology changes of " << backend_->addr() << " at " << addr_;
+    try {
+        io::stream s = connect(true);
+        bson::Object topologyVersion;
+        for (;;) {
+            // The first request is answered at once; subsequent ones
+            // are held by the server until something changes.
+            bson::ObjectBuilder cmd;
+            cmd["isMaster"] = 1;
+            if (!topologyVersion.empty()) {
+                cmd["topologyVersion"] = topologyVersion;
+                cmd["maxAwaitTimeMS"] = static_cast<int64_t>(options().topologyAwait.count());
+            }
+            bson::Object query = cmd.obj();
+            
+            io::task<bson::Object> t = io::spawn([&s, query]{
+                s << QueryComposer(Namespace("admin", "$cmd"), query).slaveOK() << std::flush;
+                return readReply(s, 0);
+            });
+            io::wait(t, topologyVersion.empty() ? options().pingTimeout : options().topologyAwait + options().pingTimeout);
+            if (!t.completed())
+                throw std::runtime_error("timeout");
+            
+            bson::Object reply = t.get();
+            if (reply["ok"].as<int>(0) != 1)
+                throw std::runtime_error("negative reply to isMaster command");
+            if (!reply["topologyVersion"].exists()) {
+                DEBUG(1) << backend_->addr() << " does not support awaitable isMaster";
+                return;
+            }
+            if (!topologyVersion.empty()) {
+                // The member is able to hold a request, so forget past failures
+                std::unique_lock<io::sys::mutex> lock(mutex_);
+                watchFailures_ = 0;
+            }
+            topologyVersion = reply["topologyVersion"].as<bson::Object>();
+            
+            bool changed;
+            {
+                std::unique_lock<io::sys::mutex> lock(mutex_);
+                changed = (fingerprint(reply) != fingerprint_);
+            }
+            if (changed) {
+                DEBUG(1) << backend_->addr() << " at " << addr_ << " reports a topology change";
+                unsettle();
+                pingNow();
+            }
+        }
+    }
+    catch (std::exception& e) {
+        DEBUG(1) << "Topology watch of " << backend_->addr() << " at " << addr_ << " failed: " << e.what();
+    }
+    
+    // Something in between (say, a proxy dropping long-held requests) may be
+    // breaking the watch of a healthy member, so back off before restarting
+    // it: one ping interval after the first failure, doubling up to 64.
+    static const unsigned MAX_BACKOFF_SHIFT = 6;
+    {
+        std::unique_lock<io::sys::mutex> lock(mutex_);
+        watchRetryAt_ = SteadyClock::now() + options().pingInterval * (1u << std::min(watchFailures_, MAX_BACKOFF_SHIFT));
+        ++watchFailures_;
+    }
+    
+    // The member may have gone down; find out right away (a dead member is
+    // unsettled by setDead()). Regular pings take over from here and restart
+    // the watch once the member is back.
+    pingNow(false);
+}
+
+void Endpoint::unsettle()
+{
+    static const unsigned SETTLE_PINGS = 3;
+    unsettled_ = SETTLE_PINGS;
+}
 
+void Backend::endpointAlive(Endpoint* pt, bson::Object status)
+{
     {
         std::unique_lock<io::sys::shared_mutex> lock(mutex_);
         if (pid(status_) != pid(status))
             permanentErrmsg_.clear();
+        updateLoad(status["server_status"].as<bson::Object>(bson::Object()));
         status_ = std::move(status);
     }
 
-    if (pt->roundtrip() < nearest_.get().value()->roundtrip())
-        nearest_.assign(pt);
+    if (pt->expectedRoundtrip() < nearest_.load()->expectedRoundtrip())
+        nearest_ = pt;
     
     if (shard_)
         shard_->backendUpdated(this);
@@ -340,6 +1201,52 @@ void Backend::endpointAlive(Endpoint* pt, bson::Object status)
     pinged_ = true;
 }
 
+void Backend::updateLoad(const bson::Object& serverStatus)
+{
+    auto number = [](const bson::Element& elt) {
+        return elt.exists() && elt.canBe<double>() ? elt.as<double>() : 0.0;
+    };
+    auto sum = [&number](const bson::Element& counters) {
+        double ret = 0;
+        if (counters.exists() && counters.is<bson::Object>())
+            for (const bson::Element& elt: counters.as<bson::Object>())
+                ret += number(elt);
+        return ret;
+    };
+    
+    ServerLoad load;
+    load.queued = number(serverStatus["globalLock"]["currentQueue"]["total"]);
+    load.active = number(serverStatus["globalLock"]["activeClients"]["total"]);
+    
+    // Operations applied by replication keep a secondary busy just as well.
+    double ops = sum(serverStatus["opcounters"]) + sum(serverStatus["opcountersRepl"]);
+    int64_t uptime = static_cast<int64_t>(number(serverStatus["uptimeMillis"]));
+    if (uptimeMillis_ >= 0 && uptime > uptimeMillis_ && ops >= opcounters_) {
+        load.opsPerSec = (ops - opcounters_) * 1000 / (uptime - uptimeMillis_);
+    } else {
+        // First ping, or the server has been restarted
+        load.opsPerSec = load_.opsPerSec;
+    }
+    
+    load_ = load;
+    queueDelay_.store(load.queueDelay(), std::memory_order_relaxed);
+    opcounters_ = ops;
+    uptimeMillis_ = uptime;
+}
+
+std::chrono::microseconds Backend::ServerLoad::queueDelay() const
+{
+    // A server not making any progress (say, blocked by a foreground
+    // index build) is treated as if it took this long to serve a request.
+    static const std::chrono::microseconds MAX_DELAY = std::chrono::seconds(10);
+    
+    if (queued <= 0)
+        return std::chrono::microseconds::zero();
+    if (queued >= opsPerSec * std::chrono::duration_cast<std::chrono::duration<double> >(MAX_DELAY).count())
+        return MAX_DELAY;
+    return std::chrono::microseconds(static_cast<std::chrono::microseconds::rep>(queued / opsPerSec * 1000000));
+}
+
 void Backend::endpointDead(Endpoint* pt)
 {
     if (pt->wasAlive()) {
@@ -347,7 +1254,7 @@ void Backend::endpointDead(Endpoint* pt)
             std::unique_lock<io::sys::shared_mutex> lock(mutex_);
             status_ = bson::Object();
         }
-        nearest_.clear();
+        nearest_ = calcNearest();
 
         if (shard_)
             shard_->backendUpdated(this);
@@ -356,10 +1263,16 @@ void Backend::endpointDead(Endpoint* pt)
     pinged_ = true;
 }
 
+void Backend::endpointSlowedDown(Endpoint* pt)
+{
+    if (endpts_.size() > 1 && pt == nearest_.load())
+        nearest_ = calcNearest();
+}
+
 Endpoint* Backend::calcNearest() const
 {
     auto i = std::min_element(endpts_.begin(), endpts_.end(),
-        [](const EndptPtr& a, const EndptPtr& b) { return a->roundtrip() < b->roundtrip(); });
+        [](const EndptPtr& a, const EndptPtr& b) { return a->expectedRoundtrip() < b->expectedRoundtrip(); });
     assert(i != endpts_.end());
     return i->get();
 }
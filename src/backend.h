@@ -28,8 +28,11 @@
 #pragma once
 
 #include "proto.h"
-#include "lazy.h"
 #include "version.h"
+#include "options.h"
+#include "clock.h"
+#include "latency.h"
+#include "outlier.h"
 #include <syncio/syncio.h>
 #include <bson/bson.h>
 #include <chrono>
@@ -39,6 +42,8 @@
 #include <atomic>
 #include <iostream>
 #include <map>
+#include <deque>
+#include <unordered_map>
 #include <initializer_list>
 #include <cassert>
 
@@ -59,6 +64,7 @@ public:
 
     bool exists() const { return !!impl_; }
     Endpoint& endpoint() const { assert(exists()); return *impl_->endpt; }
+    bool isPrimary() const { assert(exists()); return impl_->isPrimary; }
     Backend& backend() const;
     
     /// Initiates the connection if neccessary, associates it with version `v'
@@ -79,23 +85,96 @@ public:
     void release();
 
 private:
+    /// Shared by an endpoint and its connections; cleared when the endpoint
+    /// goes away, so a connection closed later does not touch it.
+    struct Anchor {
+        io::sys::mutex mutex;
+        Endpoint* endpt;
+        explicit Anchor(Endpoint* e): endpt(e) {}
+    };
+
     struct Impl {
         Endpoint* endpt = 0;
+        std::shared_ptr<Anchor> anchor; // null for connections not counted in the pool
         bool isPrimary = false;
         bool authenticated = false;
         io::stream s;
-        std::map<std::string, ChunkVersion> versions;
+        SteadyClock::time_point idleSince; // when put into the pool
+        std::unordered_map<uint32_t, ChunkVersion> versions; // indexed by Namespace::id()
         
-        Impl(Endpoint* ept, bool primary):
-            endpt(ept), isPrimary(primary) {}
+        Impl(Endpoint* ept, bool primary);
+        ~Impl();
     };
     std::unique_ptr<Impl> impl_;
     
+    /// Authenticates the connection and associates it with version `v' of `ns'
+    /// (if needed) and sends the message. If the message is a read, all of these
+    /// are pipelined, so the whole handshake takes a single round trip (plus
+    /// one for getnonce). Returns false if the connection turned out to be broken.
+    bool handshake(const Namespace& ns, const ChunkVersion& v, const char* msg, size_t len);
+    
     void authenticate();
-    void trySetVersion(const Namespace& ns, const ChunkVersion& v);
+    std::string getNonce();
+    QueryComposer authCommand(const std::string& nonce);
+    void checkAuthReply(const bson::Object& reply);
+    
+    QueryComposer setVersionCommand(const Namespace& ns, const ChunkVersion& v);
+    
+    /// Returns false if setShardVersion should be retried; throws on other errors.
+    bool checkSetVersionReply(const Namespace& ns, const ChunkVersion& v, const bson::Object& reply);
+    
     void stepDown(std::chrono::seconds duration);
     
     friend class Endpoint;
+    friend class PipelinedConnection;
+};
+
+
+/// A connection to an endpoint shared by many coroutines at once.
+/// Requests are written as they come and replies are matched to them
+/// by `responseTo', so any number of requests can be in flight.
+/// mongod serves requests from one connection sequentially, so only
+/// cheap requests (pings, OP_KILL_CURSORS and such) should go here.
+class PipelinedConnection {
+public:
+    explicit PipelinedConnection(Endpoint* endpt): endpt_(endpt), lastReqID_(0), resetRequested_(false) {}
+    
+    /// Sends all queries in one go and returns first documents of their replies.
+    /// Does not time out by itself; callers are expected to take care of that.
+    std::vector<bson::Object> roundtrip(std::vector<QueryComposer> queries);
+    
+    /// Sends a message which expects no reply (e.g. OP_KILL_CURSORS).
+    void send(const std::vector<char>& msg);
+    
+    /// Makes the next request open a new connection.
+    void reset() { resetRequested_ = true; }
+    
+private /*fields*/:
+    struct Request;
+    struct Session {
+        Connection conn;
+        std::atomic<bool> closed { false };
+    };
+    
+    Endpoint* endpt_;
+    std::atomic<uint32_t> lastReqID_;
+    std::atomic<bool> resetRequested_;
+    io::sys::mutex mutex_;
+    std::map< uint32_t, std::shared_ptr<Request> > pending_;
+    io::mutex writeMutex_;
+    std::shared_ptr<Session> session_; // guarded by `writeMutex_'
+    io::task<void> reader_;
+
+private /*methods*/:
+    /// Writes `data' carrying requests `reqs' over the current session,
+    /// opening a new one if needed.
+    void write(const std::vector<char>& data, const std::vector< std::shared_ptr<Request> >& reqs);
+    void readReplies(std::shared_ptr<Session> session);
+    void complete(uint32_t reqID, bson::Object reply, std::string errmsg);
+    static void finish(const std::shared_ptr<Request>& r, bson::Object reply, std::string errmsg);
+    
+    /// Fails all pending requests sent over `session'.
+    void failAll(const std::shared_ptr<Session>& session, const std::string& errmsg);
 };
 
 
@@ -108,25 +187,49 @@ private:
 class Endpoint {
 public:
     explicit Endpoint(Backend* backend, const io::addr& addr):
-        backend_(backend), addr_(addr), roundtrip_(std::chrono::microseconds::max()), pinged_(false)
+        backend_(backend), addr_(addr), roundtrip_(std::chrono::microseconds::max()),
+        anchor_(std::make_shared<Connection::Anchor>(this)),
+        pipe_(this), pinged_(false)
     {
         ping_ = io::spawn([this]{ keepPing(); });
+        if (options().connIdleTimeout != std::chrono::milliseconds::max())
+            reaper_ = io::spawn([this]{ keepReaping(); });
     }
     
+    ~Endpoint();
+    
+    Endpoint(const Endpoint&) = delete;
+    Endpoint& operator = (const Endpoint&) = delete;
+    
     Backend& backend() const { return *backend_; }
     const io::addr& addr() const { return addr_; }
     
     /// Endpoint status.
-    std::chrono::microseconds roundtrip() const { return roundtrip_; }
+    std::chrono::microseconds roundtrip() const { return roundtrip_.load(std::memory_order_relaxed); }
     bool alive() const { return !pinged_ || roundtrip() != std::chrono::microseconds::max(); }
     bool wasAlive() const { return prevRoundtrip_ != std::chrono::microseconds::max(); }
     
+    /// Number of connections currently in use, i.e. requests in flight.
+    size_t inFlight() const { return inFlight_.load(std::memory_order_relaxed); }
+    
+    /// Latency of actual requests to the endpoint.
+    const LatencyEstimator& latency() const { return latency_; }
+    void requestCompleted(std::chrono::microseconds latency);
+    
+    /// Roundtrip time to expect from a request: ping roundtrip time,
+    /// unless requests sent recently took longer on average. Kept up to date
+    /// as pings and requests complete, so reading it takes no locks.
+    std::chrono::microseconds expectedRoundtrip() const { return expectedRoundtrip_.load(std::memory_order_relaxed); }
+    
     
     /// Fetches a cached connection to the backend or creates a new one.
-    Connection getAny() { return get(conns_); }
+    /// If `--conn-pool-max' connections are already open, waits for one
+    /// to be released (in FIFO order) for at most `--conn-wait-timeout'
+    /// or, unless `wait' is set, returns NULL at once.
+    Connection getAny(bool wait = true) { return get(conns_, wait); }
     
     /// Same as above, but returned connection presumably has shard versioning support
-    Connection getPrimary() { return get(primaries_); }
+    Connection getPrimary(bool wait = true) { return get(primaries_, wait); }
 
     /// Puts the connection back into the connection pool.
     void release(Connection&& c);
@@ -139,29 +242,123 @@ public:
     void flush();
     
     /// Performs a synchronous ping. Returns fresh endpoint status (alive()).
-    bool pingNow();
+    /// Unless `full' is set, only a cheap `isMaster' is issued if it reports
+    /// no changes and full backend status has been fetched recently
+    /// (see `--ping-status-interval').
+    bool pingNow(bool full = true);
+    
+    /// Marks the endpoint as recently changed, so it is pinged more often for a while.
+    void unsettle();
+    
+    /// A connection used for pings and other cheap requests.
+    PipelinedConnection& pipe() { return pipe_; }
+    
+    /// Opens a new connection to the endpoint. At most `--connect-concurrency'
+    /// connections are established at once, and at most `--connect-rate' per second
+    /// (delayed attempts are jittered). If `--connect-queue' requests are already
+    /// waiting, throws errors::Throttled. Urgent connections (for pings) bypass
+    /// all of these limits.
+    io::stream connect(bool urgent = false);
+    
+    struct PoolStats {
+        size_t open = 0;        // connections currently open
+        size_t idle = 0;        // ... of which are not in use
+        size_t waiting = 0;     // requests waiting for a connection
+        size_t target = 0;      // idle connections kept, as adapted to recent load
+        uint64_t created = 0;
+        uint64_t reused = 0;
+        uint64_t reaped = 0;    // idle connections found stale and closed
+        uint64_t waits = 0;
+        uint64_t waitTimeouts = 0;
+        std::chrono::microseconds waitTime { 0 }; // total time spent in waiting
+        size_t connecting = 0;  // connections being established
+        uint64_t throttled = 0; // connection attempts rejected by `--connect-queue'
+    };
+    
+    PoolStats poolStats() const;
     
 private /*fields*/:
+    struct Waiter;
+    
     Backend* backend_;
     io::addr addr_;
-    std::chrono::microseconds roundtrip_;
+    std::atomic<std::chrono::microseconds> roundtrip_;
     std::chrono::microseconds prevRoundtrip_;
-    io::task<void> ping_;
+    LatencyEstimator latency_;
+    std::atomic<std::chrono::microseconds> expectedRoundtrip_ { std::chrono::microseconds::max() };
+    
+    // Members are destroyed in reverse order; cached connections
+    // refer to `mutex_' and `stats_' when closed.
+    mutable io::sys::mutex mutex_;
+    PoolStats stats_;
+    size_t peakInUse_ = 0;
+    std::atomic<size_t> inFlight_ { 0 }; // stats_.open - stats_.idle, readable without the lock
+    std::deque< std::shared_ptr<Waiter> > waiters_;
+    std::shared_ptr<Connection::Anchor> anchor_;
     std::vector<Connection> conns_;
     std::vector<Connection> primaries_;
-    io::sys::mutex mutex_;
+    PipelinedConnection pipe_;
+    
+    io::mutex connectMutex_;
+    io::condition_variable connectCond_;
+    std::atomic<size_t> connecting_ { 0 }; // modified with `connectMutex_' held
+    size_t connectQueue_ = 0;              // guarded by `connectMutex_'
+    SteadyClock::time_point connectTat_;   // ditto; theoretical arrival time of the next connection
+    std::atomic<uint64_t> throttled_ { 0 };
+    
+    io::task<void> ping_;
     bool pinged_;
+    io::task<void> reaper_;
+    io::task<void> maintain_;
+    
+    std::string fingerprint_;                  // of the last `isMaster' reply; guarded by `mutex_'
+    SteadyClock::time_point statusFetchedAt_;  // ditto; when full status was fetched
+    std::atomic<unsigned> unsettled_ { 0 };    // pings to do at a shorter interval after a change
+    unsigned watchFailures_ = 0;               // consecutive failures of the topology watch; guarded by `mutex_'
+    SteadyClock::time_point watchRetryAt_;     // ditto; not to be restarted before
+    io::task<void> watch_;
 
 private /*methods*/:
-    Connection pop(std::vector<Connection>& v);
-    Connection get(std::vector<Connection>& v);
+    Connection get(std::vector<Connection>& v, bool wait);
+    
+    /// Takes the most recently used idle connection out of the pool, if any.
+    Connection takeIdle(std::vector<Connection>& v);
+    
+    /// Checks whether an idle connection is still worth using: it has not been
+    /// idle for too long and has not been closed by the peer (which is detected
+    /// with a non-blocking MSG_PEEK, so this is cheap).
+    static bool isUsable(const Connection& c, SteadyClock::time_point now);
+    void grant(const std::shared_ptr<Waiter>& w, Connection c);
+    void closed();
+    size_t idleLimit() const;
+    
+    /// Publishes the number of connections in use (`mutex_' must be held).
+    void inUseChanged();
+    void updateExpectedRoundtrip();
+    
+    /// Adapts pool size to the load observed since previous call,
+    /// closes excess idle connections and opens `--conn-pool-min' ones.
+    void maintainPool();
     
     /// A background routine constantly updating endpoint status.
     void keepPing();
+    
+    /// A background routine holding an awaitable `isMaster' over a dedicated
+    /// connection, so that changes of the replica set member are seen at once.
+    /// Returns if the backend does not support awaitable `isMaster', or after
+    /// a failure (keepPing() starts it again once the backend is alive).
+    void keepWatching();
+    
+    /// A background routine closing stale idle connections.
+    void keepReaping();
+    void reap();
         
     void setAlive(std::chrono::microseconds netRoundtrip,
         std::chrono::microseconds grossRoundtrip, bson::Object obj);
     void setDead(const std::string& reason);
+    
+    friend class Connection;
+    friend class PipelinedConnection;
 };
 
 
@@ -171,11 +368,11 @@ class Backend {
 public:
     explicit Backend(Shard* shard, const std::string& addr):
         shard_(shard), addr_(addr),
-        nearest_([this]{ return calcNearest(); }),
         pinged_(false)
     {
         for (const io::addr& a: io::resolve(addr))
             endpts_.emplace_back(new Endpoint(this, a));
+        nearest_ = calcNearest();
     }
 
     Shard* shard() const { return shard_; }
@@ -193,10 +390,36 @@ public:
         return permanentErrmsg_;
     }
 
-    std::chrono::microseconds roundtrip() const { return nearest_.get().value()->roundtrip(); }
-    bool alive() const { return !pinged_ || (!status().empty() && nearest_.get().value()->alive()); }
+    /// Server load as of the last ping, derived from `serverStatus'.
+    struct ServerLoad {
+        double queued = 0;    // operations waiting for a lock (`globalLock.currentQueue')
+        double active = 0;    // operations being executed (`globalLock.activeClients')
+        double opsPerSec = 0; // rate of operations, including replicated ones, since previous ping
+        
+        /// Time a request is expected to spend in the server's queue:
+        /// the number of queued operations divided by the rate they are served at.
+        std::chrono::microseconds queueDelay() const;
+    };
+    
+    ServerLoad load() const
+    {
+        io::shared_lock<io::sys::shared_mutex> lock(mutex_);
+        return load_;
+    }
+    
+    /// Same as load().queueDelay(), but takes no locks.
+    std::chrono::microseconds queueDelay() const { return queueDelay_.load(std::memory_order_relaxed); }
     
-    Endpoint* endpoint() const { return nearest_.get().value(); }
+    std::chrono::microseconds roundtrip() const { return endpoint()->roundtrip(); }
+    size_t inFlight() const { return endpoint()->inFlight(); }
+    std::chrono::microseconds expectedRoundtrip() const { return endpoint()->expectedRoundtrip(); }
+    bool alive() const { return !pinged_ || (!status().empty() && endpoint()->alive()); }
+    
+    /// The endpoint with the least expected roundtrip.
+    Endpoint* endpoint() const { return nearest_.load(std::memory_order_acquire); }
+    
+    OutlierDetector& outlier() { return outlier_; }
+    const OutlierDetector& outlier() const { return outlier_; }
     
     const std::vector< std::unique_ptr<Endpoint> >& endpoints() const { return endpts_; }
     
@@ -237,15 +460,24 @@ private:
     std::string addr_;
     bson::Object status_;
     std::vector<EndptPtr> endpts_;
-    Lazy<Endpoint*> nearest_;
+    std::atomic<Endpoint*> nearest_ { nullptr };
     std::string permanentErrmsg_;
     bool pinged_;
     mutable io::sys::shared_mutex mutex_;
+    OutlierDetector outlier_;
+    ServerLoad load_;
+    std::atomic<std::chrono::microseconds> queueDelay_ { std::chrono::microseconds::zero() };
+    double opcounters_ = 0;     // total operations as of the last ping...
+    int64_t uptimeMillis_ = -1; // ... and the server uptime then
     
     void endpointAlive(Endpoint* pt, bson::Object status);
     void endpointDead(Endpoint* pt);
+    void endpointSlowedDown(Endpoint* pt);
     Endpoint* calcNearest() const;
     
+    /// Updates `load_' with a fresh `serverStatus' reply (`mutex_' must be held).
+    void updateLoad(const bson::Object& serverStatus);
+    
     friend class Endpoint;
 };
 
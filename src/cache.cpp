@@ -27,6 +27,8 @@
 
 #include "cache.h"
 #include "log.h"
+#include "auth.h"
+#include <bson/bson11.h>
 #include <fstream>
 #include <utility>
 #include <cstring>
@@ -34,16 +36,184 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 namespace {
     static const int CACHE_VERSION = 1;
+    
+    static const char CONFIG_MAGIC[8] = { 'M', 'O', 'N', 'G', 'O', 'Z', 'C', 'F' };
+    static const uint32_t CONFIG_VERSION = 2;
+    
+    struct ConfigHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved;
+        uint64_t metaOffset;
+        uint64_t metaSize;
+        char metaMd5[32]; // hex
+    } __attribute__((packed));
+    
+    void writeFile(const std::string& filename, const char* p, size_t size)
+    {
+        // There is no std::ostream accepting permissions for file being created, so write by hand
+        int fd = open((filename + ".tmp").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd != -1) {
+            const char *pe = p + size;
+            while (p != pe) {
+                ssize_t sz = ::write(fd, p, pe - p);
+                if (sz > 0) {
+                    p += sz;
+                } else {
+                    WARN() << "cannot update " << filename << ": " << strerror(errno);
+                    ::close(fd);
+                    ::unlink((filename + ".tmp").c_str());
+                    return;
+                }
+            }
+            ::close(fd);
+            ::rename((filename + ".tmp").c_str(), filename.c_str());
+        } else {
+            WARN() << "cannot update " << filename << ": " << strerror(errno);
+        }
+    }
+}
+
+
+std::shared_ptr<MappedConfig> MappedConfig::open(const std::string& filename)
+{
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd == -1)
+        return {};
+    
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(ConfigHeader)) {
+        ::close(fd);
+        return {};
+    }
+    
+    void* p = ::mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) {
+        WARN() << "cannot map " << filename << ": " << strerror(errno);
+        return {};
+    }
+    
+    std::shared_ptr<MappedConfig> ret(new MappedConfig);
+    ret->data_ = static_cast<const char*>(p);
+    ret->size_ = st.st_size;
+    
+    ConfigHeader hdr;
+    memcpy(&hdr, ret->data_, sizeof(hdr));
+    if (memcmp(hdr.magic, CONFIG_MAGIC, sizeof(CONFIG_MAGIC)) != 0 || hdr.version != CONFIG_VERSION)
+        return {};
+    
+    if (hdr.metaOffset < sizeof(hdr) || hdr.metaSize > ret->size_ || hdr.metaOffset > ret->size_ - hdr.metaSize
+        || auth::md5hex(ret->data_ + hdr.metaOffset, hdr.metaSize) != std::string(hdr.metaMd5, sizeof(hdr.metaMd5))
+    ) {
+        WARN() << filename << " is damaged; ignoring";
+        return {};
+    }
+    
+    try {
+        ret->meta_ = bson::Object::construct(ret->data_ + hdr.metaOffset, hdr.metaSize);
+        for (bson::Element elt: ret->meta_["index"].as<bson::Array>()) {
+            uint64_t offset = elt["offset"].as<int64_t>();
+            uint64_t size = elt["size"].as<int64_t>();
+            if (offset < sizeof(hdr) || size > ret->size_ || offset > ret->size_ - size)
+                throw std::runtime_error("section out of bounds");
+            
+            // Sections are not read here: hashing the whole file would delay
+            // serving the first request; see chunks().
+            Section& s = ret->sections_[elt["ns"].as<std::string>()];
+            s.offset = offset;
+            s.size = size;
+            s.md5 = elt["md5"].as<std::string>();
+        }
+    }
+    catch (std::exception& e) {
+        WARN() << filename << " is damaged: " << e.what() << "; ignoring";
+        return {};
+    }
+    
+    return ret;
+}
+
+MappedConfig::~MappedConfig()
+{
+    if (data_)
+        ::munmap(const_cast<char*>(data_), size_);
 }
 
-Cache::Cache(std::string filename): filename_(filename)
+bson::Array MappedConfig::chunks(const std::string& ns) const
+{
+    auto i = sections_.find(ns);
+    if (i == sections_.end())
+        return bson::Array();
+    
+    const Section& s = i->second;
+    int state = s.state.load(std::memory_order_acquire);
+    if (state == Section::UNCHECKED) {
+        // Concurrent first accesses may both hash the section; that is harmless.
+        // Chunks of a damaged section are fetched from config servers instead.
+        state = (auth::md5hex(data_ + s.offset, s.size) == s.md5) ? Section::GOOD : Section::DAMAGED;
+        if (state == Section::DAMAGED)
+            WARN() << "cached chunks of " << ns << " are damaged; ignoring";
+        s.state.store(state, std::memory_order_release);
+    }
+    if (state == Section::DAMAGED)
+        return bson::Array();
+    return bson::Array::construct(data_ + s.offset, s.size);
+}
+
+std::vector<char> MappedConfig::serialize(const bson::Object& config)
+{
+    std::map<std::string, bson::ArrayBuilder> chunks;
+    for (bson::Element chunk: config["chunks"].as<bson::Array>())
+        chunks[chunk["ns"].as<std::string>()] << chunk;
+    
+    std::vector<char> ret(sizeof(ConfigHeader));
+    bson::ArrayBuilder index;
+    for (auto&& kv: chunks) {
+        bson::Array arr = kv.second.array();
+        index << bson::object(
+            "ns", kv.first,
+            "offset", (int64_t) ret.size(),
+            "size", (int64_t) arr.rawSize(),
+            "md5", auth::md5hex(arr.rawData(), arr.rawSize())
+        );
+        ret.insert(ret.end(), arr.rawData(), arr.rawData() + arr.rawSize());
+    }
+    
+    bson::ObjectBuilder b;
+    for (bson::Element elt: config)
+        if (std::string(elt.name()) != "chunks")
+            b[elt.name()] = elt;
+    b["index"] = index.array();
+    bson::Object meta = b.obj();
+    
+    ConfigHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, CONFIG_MAGIC, sizeof(CONFIG_MAGIC));
+    hdr.version = CONFIG_VERSION;
+    hdr.metaOffset = ret.size();
+    hdr.metaSize = meta.rawSize();
+    std::string metaMd5 = auth::md5hex(meta.rawData(), meta.rawSize());
+    memcpy(hdr.metaMd5, metaMd5.data(), sizeof(hdr.metaMd5));
+    
+    ret.insert(ret.end(), meta.rawData(), meta.rawData() + meta.rawSize());
+    memcpy(ret.data(), &hdr, sizeof(hdr));
+    return ret;
+}
+
+
+Cache::Cache(std::string filename): filename_(filename), dataChanged_(false), stopped_(false)
 {
     if (filename.empty())
         return;
     
+    writer_ = std::thread([this]{ keepWriting(); });
+    shardConfig_ = MappedConfig::open(filename + ".config");
+    
     std::ifstream f(filename.c_str());
     std::vector<char> buf(sizeof(uint32_t), 0);
     if (!f.read(buf.data(), buf.size()))
@@ -67,9 +237,26 @@ Cache::Cache(std::string filename): filename_(filename)
         map.insert(std::make_pair(elt.name(), elt.as<bson::Object>()));
     }
     
+    // Shard config used to be stored here; now it lives in a file of its own.
+    map.erase("shard_config");
+    
+    std::unique_lock<io::sys::mutex> lock(mutex_);
     data_ = std::move(map);
 }
 
+Cache::~Cache()
+{
+    if (!writer_.joinable())
+        return;
+    
+    {
+        std::unique_lock<io::sys::mutex> lock(mutex_);
+        stopped_ = true;
+    }
+    cond_.notify_all();
+    writer_.join();
+}
+
 
 bson::Object Cache::get(const std::string& key)
 {
@@ -84,32 +271,60 @@ void Cache::put(const std::string& key, bson::Object value)
     if (filename_.empty())
         return;
 
-    std::unique_lock<io::sys::mutex> lock(mutex_);
-    data_[key] = value;
+    {
+        std::unique_lock<io::sys::mutex> lock(mutex_);
+        data_[key] = value;
+        dataChanged_ = true;
+    }
+    cond_.notify_all();
+}
 
-    bson::ObjectBuilder b;
-    b["version"] = CACHE_VERSION;
-    for (auto&& kv: data_)
-        b[kv.first] = kv.second;
-    bson::Object obj = b.obj();
-    
-    // There is no std::ostream accepting permissions for file being created, so write by hand
-    int fd = open((filename_ + ".tmp").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
-    if (fd != -1) {
-        const char *p = obj.rawData(), *pe = p + obj.rawSize();
-        while (p != pe) {
-            ssize_t sz = ::write(fd, p, pe - p);
-            if (sz > 0) {
-                p += sz;
-            } else {
-                ::unlink((filename_ + ".tmp").c_str());
+
+void Cache::putShardConfig(bson::Object config)
+{
+    if (filename_.empty())
+        return;
+    
+    {
+        std::unique_lock<io::sys::mutex> lock(mutex_);
+        pendingConfig_ = config;
+    }
+    cond_.notify_all();
+}
+
+
+void Cache::keepWriting()
+{
+    for (;;) {
+        std::map<std::string, bson::Object> data;
+        bool dataChanged;
+        bson::Object config;
+        {
+            std::unique_lock<io::sys::mutex> lock(mutex_);
+            cond_.wait(lock, [this]{ return stopped_ || dataChanged_ || !pendingConfig_.empty(); });
+            if (!dataChanged_ && pendingConfig_.empty())
                 return;
-            }
+            
+            dataChanged = dataChanged_;
+            if (dataChanged_)
+                data = data_;
+            dataChanged_ = false;
+            std::swap(config, pendingConfig_);
+        }
+        
+        if (dataChanged) {
+            bson::ObjectBuilder b;
+            b["version"] = CACHE_VERSION;
+            for (auto&& kv: data)
+                b[kv.first] = kv.second;
+            bson::Object obj = b.obj();
+            writeFile(filename_, obj.rawData(), obj.rawSize());
+        }
+        
+        if (!config.empty()) {
+            std::vector<char> buf = MappedConfig::serialize(config);
+            writeFile(filename_ + ".config", buf.data(), buf.size());
         }
-        ::close(fd);
-        ::rename((filename_ + ".tmp").c_str(), filename_.c_str());
-    } else {
-        WARN() << "cannot update " << filename_ << ": " << strerror(errno);
     }
 }
 
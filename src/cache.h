@@ -29,20 +29,84 @@
 
 #include <bson/bson.h>
 #include <syncio/syncio.h>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <vector>
 #include <map>
 #include <string>
 
+/// A shard config stored in a memory-mapped file in a binary format.
+/// Chunks of each collection are kept in a separate checksummed section,
+/// so they can be used without reading and parsing the whole file.
+class MappedConfig {
+public:
+    /// Maps the file into memory. Returns NULL if the file does not exist,
+    /// is of an incompatible version or damaged.
+    static std::shared_ptr<MappedConfig> open(const std::string& filename);
+    ~MappedConfig();
+    
+    /// Shards, databases and collections (but not chunks) of the config.
+    const bson::Object& meta() const { return meta_; }
+    
+    /// Returns chunks of collection `ns' (or an empty array if there are none,
+    /// or if the section is damaged). Only the header and meta are verified
+    /// when the file is mapped; each section is checked on its first access.
+    bson::Array chunks(const std::string& ns) const;
+    
+    /// Converts a shard config into the binary format.
+    static std::vector<char> serialize(const bson::Object& config);
+    
+private:
+    struct Section {
+        enum State { UNCHECKED, GOOD, DAMAGED };
+        
+        uint64_t offset = 0;
+        uint64_t size = 0;
+        std::string md5; // hex
+        mutable std::atomic<int> state { UNCHECKED };
+    };
+    
+    const char* data_;
+    size_t size_;
+    bson::Object meta_;
+    std::map<std::string, Section> sections_;
+    
+    MappedConfig(): data_(0), size_(0) {}
+    MappedConfig(const MappedConfig&) = delete;
+    MappedConfig& operator = (const MappedConfig&) = delete;
+};
+
+
+/// A persistent storage for various data fetched from config servers.
+/// All disk writes are performed in a dedicated thread.
 class Cache {
 public:
     explicit Cache(std::string filename);
+    ~Cache();
     
     bson::Object get(const std::string& key);
     void put(const std::string& key, bson::Object value);
     
-private:
+    /// Returns a shard config loaded upon startup (may be NULL).
+    std::shared_ptr<MappedConfig> shardConfig() const { return shardConfig_; }
+    void putShardConfig(bson::Object config);
+    
+private /*methods*/:
+    void keepWriting();
+    
+private /*fields*/:
     std::string filename_;
     std::map<std::string, bson::Object> data_;
+    std::shared_ptr<MappedConfig> shardConfig_;
+    
+    bool dataChanged_;
+    bson::Object pendingConfig_;
+    bool stopped_;
     io::sys::mutex mutex_;
+    std::condition_variable_any cond_;
+    std::thread writer_;
 };
 
 extern std::unique_ptr<Cache> g_cache;
@@ -31,11 +31,13 @@
 #include "options.h"
 #include "cache.h"
 #include "parallel.h"
+#include "auth.h"
 #include <set>
 #include <syncio/syncio.h>
 #include <bson/bson11.h>
 #include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <openssl/md5.h>
 
 
@@ -131,6 +133,13 @@ size_t hash(const bson::Element& elt)
     return out;
 }
 
+/// Copies `obj' into a storage of its own, so it does not keep
+/// the enclosing document alive.
+bson::Object detach(const bson::Object& obj)
+{
+    return bson::Object::construct(obj.rawData(), obj.rawSize());
+}
+
 } // namespace
 
 
@@ -155,7 +164,11 @@ Config::Chunk::Chunk(Namespace ns, std::string shard):
     shardID_(std::move(shard))
 {}
 
-void Config::Chunk::link(Config& conf) { shard_ = conf.shard(shardID_); }
+void Config::Chunk::link(const Config& conf)
+{
+    shard_ = conf.shard(shardID_);
+    std::string().swap(shardID_);
+}
 
 
 
@@ -170,19 +183,168 @@ void Config::Database::link(Config& conf) { primary_ = conf.shard(primaryID_); }
 
 
 Config::Collection::Collection(const bson::Object& obj):
+    conf_(0),
     ns_(obj["_id"].as<std::string>()),
     isDropped_(obj["dropped"].as<bool>()),
-    shardingKey_(obj["key"].as<bson::Object>())
-{}
+    shardingKey_(detach(obj["key"].as<bson::Object>())),
+    epoch_(obj["lastmodEpoch"].as<bson::ObjectID>(bson::ObjectID())),
+    state_(new State)
+{
+    touch(SteadyClock::now());
+}
 
-void Config::Collection::link(Config& conf)
+void Config::Collection::link(Config& conf) { conf_ = &conf; }
+
+std::shared_ptr<const Config::Collection::Routing> Config::Collection::load(const bson::Array& objs) const
 {
-    range_ = std::equal_range(conf.chunks().begin(), conf.chunks().end(), ns_.ns(),
-        SortedVector<Chunk, std::string>::Cmp([](const Chunk& ch) { return ch.ns().ns(); }));
+    std::shared_ptr<Routing> routing = std::make_shared<Routing>();
+    Chunks* chunks = &routing->chunks;
+    for (const bson::Element& elt: objs)
+        chunks->emplace_back(elt.as<bson::Object>());
+    
+    std::sort(chunks->begin(), chunks->end(),
+        [](const Chunk& a, const Chunk& b) { return a.lowerBound() < b.lowerBound(); });
+    
+    for (Chunk& ch: *chunks) {
+        try {
+            ch.link(*conf_);
+        }
+        catch (std::out_of_range&) {
+            throw errors::ShardConfigStale("a chunk of collection " + ns_.ns() + " refers to an unknown shard");
+        }
+    }
     
-    for (auto j = range_.first, i = j++, ie = range_.second; i != ie && j != ie; ++i, ++j)
+    for (auto j = chunks->begin(), i = j++, ie = chunks->end(); i != ie && j != ie; ++i, ++j)
         if (i->upperBound() != j->lowerBound())
             throw std::runtime_error("gap in partition of collection " + ns_.ns());
+    
+    // Bounds refer to the BSON the chunks have been parsed from (which can be
+    // the whole config dump); move them to a compact storage of their own.
+    // Since chunks have no gaps, each bound is stored only once.
+    if (!chunks->empty()) {
+        bson::ArrayBuilder b;
+        for (const Chunk& ch: *chunks)
+            b << ch.lowerBound();
+        b << chunks->back().upperBound();
+        routing->bounds = b.array();
+        
+        auto bound = routing->bounds.begin();
+        bson::Object min = (*bound++).as<bson::Object>();
+        for (Chunk& ch: *chunks) {
+            bson::Object max = (*bound++).as<bson::Object>();
+            ch.setBounds(min, max);
+            min = max;
+        }
+    }
+    
+    std::map<Shard*, ChunkVersion> versions;
+    for (const Chunk& ch: *chunks) {
+        auto i = versions.find(ch.shard().get());
+        if (i == versions.end()) {
+            versions.insert(std::make_pair(ch.shard().get(), ch.version()));
+        } else if (i->second.epoch() != ch.version().epoch()) {
+            throw errors::ShardConfigBroken(
+                "chunks epochs differ for collection " + ns_.ns() + " and shard " + ch.shard()->connectionString());
+        } else if (i->second.stamp() < ch.version().stamp()) {
+            i->second = ch.version();
+        }
+    }
+    
+    for (Chunk& ch: *chunks)
+        ch.setVersion(versions.find(ch.shard().get())->second);
+    
+    std::map<Shard*, std::shared_ptr<Shard>> shards;
+    for (const Chunk& ch: *chunks)
+        shards.insert(std::make_pair(ch.shard().get(), ch.shard()));
+    for (auto&& s: shards)
+        routing->shards.push_back({ s.second, versions.find(s.first)->second });
+    
+    return routing;
+}
+
+std::shared_ptr<const Config::Collection::Chunks> Config::Collection::chunks() const
+{
+    std::shared_ptr<const Routing> r = routing();
+    return std::shared_ptr<const Chunks>(r, &r->chunks);
+}
+
+std::shared_ptr<const std::vector<Config::VersionedShard>> Config::Collection::shards() const
+{
+    std::shared_ptr<const Routing> r = routing();
+    return std::shared_ptr<const std::vector<VersionedShard>>(r, &r->shards);
+}
+
+std::shared_ptr<const Config::Collection::Routing> Config::Collection::routing() const
+{
+    touch(SteadyClock::now());
+    std::shared_ptr<const Routing> r = std::atomic_load(&state_->routing);
+    if (r)
+        return r;
+    
+    if (!conf_->loader_)
+        throw errors::ShardConfigBroken("no chunks for collection " + ns_.ns());
+    
+    {
+        std::unique_lock<io::mutex> lock(state_->mutex);
+        if (state_->loading) {
+            uint64_t attempt = state_->attempts;
+            state_->cond.wait(lock, [this, attempt]{ return !state_->loading && state_->attempts != attempt; });
+            r = std::atomic_load(&state_->routing);
+            if (r)
+                return r;
+            if (state_->error)
+                std::rethrow_exception(state_->error);
+        }
+        
+        r = std::atomic_load(&state_->routing);
+        if (r)
+            return r;
+        state_->loading = true;
+    }
+    
+    // Wake up waiting requests upon return, exception or cancellation
+    std::exception_ptr error;
+    std::shared_ptr<void> guard(nullptr, [this, &error](void*) {
+        std::unique_lock<io::mutex> lock(state_->mutex);
+        state_->loading = false;
+        ++state_->attempts;
+        state_->error = error;
+        state_->cond.notify_all();
+    });
+    
+    try {
+        DEBUG(1) << "Loading chunks of collection " << ns_;
+        bson::Array objs = conf_->loader_(ns_);
+        if (objs.empty())
+            throw errors::ShardConfigStale("no chunks found for collection " + ns_.ns());
+        for (const bson::Element& elt: objs)
+            if (epoch_ != bson::ObjectID() && elt["lastmodEpoch"].as<bson::ObjectID>() != epoch_)
+                throw errors::ShardConfigStale("collection " + ns_.ns() + " has been recreated");
+        
+        r = load(objs);
+        DEBUG(1) << "Loaded " << r->chunks.size() << " chunks of collection " << ns_;
+        std::atomic_store(&state_->routing, r);
+        return r;
+    }
+    catch (std::exception&) {
+        error = std::current_exception();
+        throw;
+    }
+}
+
+bool Config::Collection::isLoaded() const
+{
+    return !!std::atomic_load(&state_->routing);
+}
+
+void Config::Collection::evict() const
+{
+    if (!conf_->loader_)
+        return;
+    
+    std::shared_ptr<const Routing> r = std::atomic_exchange(&state_->routing, std::shared_ptr<const Routing>());
+    if (r)
+        DEBUG(1) << "Evicting chunks of collection " << ns_;
 }
 
 std::vector<Config::VersionedShard> Config::find(const Namespace& ns, const bson::Object& criteria) const
@@ -223,10 +385,12 @@ std::vector<Config::VersionedShard> Config::find(const Namespace& ns, const bson
     }
     
     bson::Object head = headb.obj(), tail = tailb.obj();
-    auto doFind = [this, &ns, &hashedField](const bson::Object& key) -> VersionedShard {
+    std::shared_ptr<const Collection::Chunks> chunks = coll->chunks();
+    auto doFind = [&chunks, &hashedField](const bson::Object& key) -> VersionedShard {
         bson::Object k = hashedField.empty() ? key : bson::object(hashedField, static_cast<ssize_t>(hash(key[hashedField.c_str()])));
-        auto i = chunks_.upper_bound(std::make_pair(ns.ns(), k));
-        ASSERT(i != chunks_.begin());
+        auto i = std::upper_bound(chunks->begin(), chunks->end(), k,
+            [](const bson::Object& k, const Chunk& ch) { return k < ch.lowerBound(); });
+        ASSERT(i != chunks->begin());
         --i;
         DEBUG(2) << "found chunk " << i->lowerBound() << "..." << i->upperBound() << " for " << k;
         ASSERT(i->contains(k));
@@ -252,32 +416,18 @@ std::vector<Config::VersionedShard> Config::find(const Namespace& ns, const bson
 
 std::vector<Config::VersionedShard> Config::shards(const Namespace& ns) const
 {
-    std::map<std::shared_ptr<Shard>, ChunkVersion> map;
-    
     if (ns.db() == "config")
         return {{ configShard_, ChunkVersion() }};
 
     const Collection* c = collection(ns);
-
-    if (c) {
-        for (const Config::Chunk& chunk: *c) {
-            auto prev = map.find(chunk.shard());
-            if (prev == map.end()) {
-                map.insert(std::make_pair(chunk.shard(), chunk.version()));
-            } else {
-                assert(prev->second == chunk.version());
-            }
-        }
-    } else {
-        const Database* db = database(ns.db());
-        if (db)
-            map.insert(std::make_pair(db->primaryShard(), ChunkVersion{}));
-    }
+    if (c)
+        return *c->shards();
     
-    std::vector<VersionedShard> ret;
-    for (auto&& s: map)
-        ret.push_back({ s.first, s.second });
-    return ret;
+    const Database* db = database(ns.db());
+    if (db)
+        return {{ db->primaryShard(), ChunkVersion() }};
+    
+    return {};
 }
 
 std::vector< std::shared_ptr<Shard> > Config::shards() const
@@ -325,19 +475,18 @@ void link(Config* conf, SortedVector<T, Key>& dest)
 
 }
 
-Config::Config(std::shared_ptr<Shard> configShard, const bson::Object& obj):
-    bson_(obj),
+Config::Config(std::shared_ptr<Shard> configShard, const bson::Object& obj, ChunkLoader loader):
+    digest_(digest(obj)),
     configShard_(std::move(configShard)),
     shards_([](const std::pair<std::string, std::shared_ptr<Shard> >& s) { return s.first; }),
-    chunks_([](const Chunk& c) { return std::make_pair(c.ns().ns(), c.lowerBound()); }),
     collections_([](const Collection& c) { return c.ns().ns(); }),
     databases_([](const Database& db) { return db.name(); }),
+    loader_(std::move(loader)),
     createdAt_(SteadyClock::now())
 {
     SortedVector<ShardConf, std::string> shards([](const ShardConf& s) { return s.id(); });
     
     populate(shards, obj["shards"]);
-    populate(chunks_, obj["chunks"]);
     populate(collections_, obj["collections"]);
     populate(databases_, obj["databases"]);
     
@@ -346,26 +495,23 @@ Config::Config(std::shared_ptr<Shard> configShard, const bson::Object& obj):
             shard.id(), ShardPool::instance().get(shard.id(), shard.connstr())
         ));
 
-    link(this, chunks_);
     link(this, collections_);
     link(this, databases_);
     
-    std::map<std::pair<std::string, Shard*>, ChunkVersion> versions;
-    for (const Chunk& ch: chunks_) {
-        auto k = std::make_pair(ch.ns().ns(), ch.shard().get());
-        auto i = versions.find(k);
-        if (i == versions.end()) {
-            versions.insert(std::make_pair(k, ch.version()));
-        } else if (i->second.epoch() != ch.version().epoch()) {
-            throw errors::ShardConfigBroken(
-                "chunks epochs differ for collection " + ch.ns().ns() + " and shard " + ch.shard()->connectionString());
-        } else if (i->second.stamp() < ch.version().stamp()) {
-            i->second = ch.version();
-        }
-    }
+    for (const Collection& coll: collections_)
+        collectionsByID_.insert(std::make_pair(coll.ns().id(), &coll));
+    
+    std::map<std::string, bson::ArrayBuilder> chunks;
+    for (const bson::Element& elt: obj["chunks"].as<bson::Array>(bson::Array()))
+        chunks[elt["ns"].as<std::string>()] << elt.as<bson::Object>();
     
-    for (Chunk& ch: chunks_)
-        ch.setVersion(versions.find(std::make_pair(ch.ns().ns(), ch.shard().get()))->second);
+    for (Collection& coll: collections_) {
+        auto i = chunks.find(coll.ns().ns());
+        if (i != chunks.end())
+            std::atomic_store(&coll.state_->routing, coll.load(i->second.array()));
+        else if (!loader_)
+            std::atomic_store(&coll.state_->routing, std::shared_ptr<const Collection::Routing>(std::make_shared<Collection::Routing>()));
+    }
 }
 
 Config::~Config() {}
@@ -375,6 +521,60 @@ std::shared_ptr<Shard> Config::shard(const std::string& name) const
     return name == "config" ? configShard_ : shards_.findRef(name).second;
 }
 
+std::string Config::digest(const bson::Object& obj)
+{
+    return auth::md5hex(obj.rawData(), obj.rawSize());
+}
+
+Config::Footprint Config::footprint() const
+{
+    Footprint ret;
+    ret.bytes = sizeof(*this)
+        + std::distance(databases_.begin(), databases_.end()) * sizeof(Database)
+        + collectionsByID_.size() * (sizeof(Collection) + sizeof(Collection::State) + 2 * sizeof(void*));
+    
+    for (const Collection& coll: collections_) {
+        ++ret.collections;
+        std::shared_ptr<const Collection::Routing> r = std::atomic_load(&coll.state_->routing);
+        if (!r)
+            continue;
+        ++ret.loadedCollections;
+        ret.chunks += r->chunks.size();
+        ret.bytes += sizeof(*r)
+            + r->chunks.capacity() * sizeof(Chunk)
+            + r->shards.capacity() * sizeof(VersionedShard)
+            + (r->bounds.empty() ? 0 : r->bounds.rawSize());
+    }
+    return ret;
+}
+
+std::vector<std::string> Config::hotCollections(std::chrono::milliseconds idle) const
+{
+    SteadyClock::time_point now = SteadyClock::now();
+    std::vector<std::string> ret;
+    for (const Collection& coll: collections_)
+        if (coll.isLoaded() && now - coll.lastAccess() <= idle)
+            ret.push_back(coll.ns().ns());
+    return ret;
+}
+
+void Config::evictColdCollections(std::chrono::milliseconds idle) const
+{
+    SteadyClock::time_point now = SteadyClock::now();
+    for (const Collection& coll: collections_)
+        if (now - coll.lastAccess() > idle)
+            coll.evict();
+}
+
+void Config::inheritAccessTimes(const Config& prev) const
+{
+    for (const Collection& coll: collections_) {
+        const Collection* p = prev.collection(coll.ns());
+        if (p && p->isLoaded())
+            coll.touch(p->lastAccess());
+    }
+}
+
 
 namespace {
 
@@ -398,13 +598,24 @@ bson::Array readTable(io::stream& s, const Namespace& ns, Conditions&&... condit
     return ret.array();
 }
 
-bson::Object readconf(io::stream& stream)
+bson::Object readconf(io::stream& stream, const std::vector<std::string>& hotCollections)
 {
     bson::ObjectBuilder ret;
     ret["shards"]      = readTable(stream, Namespace("config.shards"));
     ret["databases"]   = readTable(stream, Namespace("config.databases"));
     ret["collections"] = readTable(stream, Namespace("config.collections"), "dropped", false);
-    ret["chunks"]      = readTable(stream, Namespace("config.chunks"));
+    
+    if (!options().lazyChunks) {
+        ret["chunks"]  = readTable(stream, Namespace("config.chunks"));
+    } else if (!hotCollections.empty()) {
+        bson::ArrayBuilder nss;
+        for (const std::string& ns: hotCollections)
+            nss << ns;
+        ret["chunks"]  = readTable(stream, Namespace("config.chunks"), "ns", bson::object("$in", nss.array()));
+    } else {
+        ret["chunks"]  = bson::Array();
+    }
+    
     DEBUG(1) << "Fetching config complete";
     return ret.obj();
 }
@@ -412,28 +623,30 @@ bson::Object readconf(io::stream& stream)
 } // namespace
 
 
-bson::Object ConfigHolder::fetchConfig()
+bson::Object ConfigHolder::fetch(std::function<bson::Object(io::stream&)> reader)
 {
     io::task<bson::Object> task1, task2;
-    Backend* exclude = 0;
+    Shard::Backends exclude;
     
-    static const bson::Object READ_PREFERENCE = bson::object("mode", "primaryPreferred");
-    static const uint32_t QUERY_FLAGS = messages::Query::SLAVE_OK;
+    static const std::shared_ptr<const ReadPolicy> READ_POLICY = ReadPolicy::get(
+        messages::Query::SLAVE_OK, bson::object("mode", "primaryPreferred"));
     
     auto pickBackend = [this, &exclude]() -> Connection {
-        Connection c = configShard_->readOp(QUERY_FLAGS, READ_PREFERENCE, exclude);
+        Connection c = configShard_->readOp(*READ_POLICY, exclude);
         if (c.exists()) {
             DEBUG(2) << "Using config server " << c.backend().addr();
-            exclude = &c.backend();
+            exclude.push_back(&c.backend());
         }
         return c;
     };
 
-    auto runFetch = [this, &exclude](Connection c) {
-        return io::spawn([](Connection c) -> bson::Object {
+    // The losing fetch is left to complete in background (so its connection
+    // can be reused), hence it should not refer to anything on our stack.
+    auto runFetch = [&reader](Connection c) {
+        return io::spawn([reader](Connection c) -> bson::Object {
             c.establish(Namespace(), ChunkVersion(), QueryComposer(Namespace("local", "$cmd"), bson::object("ping", 1)));
             readReply(c.stream(), 0, [](const bson::Object&){});
-            bson::Object ret = readconf(c.stream());
+            bson::Object ret = reader(c.stream());
             c.release();
             return ret;
         }, std::move(c));
@@ -447,13 +660,22 @@ bson::Object ConfigHolder::fetchConfig()
         throw errors::BackendInternalError("no config servers available yet");
     
     TaskPool<bson::Object> pool;
+    pool.drainLosers(options().retransmitGrace);
+    RetransmitBudget& budget = configShard_->retransmitBudget();
+    if (retransmit.finite())
+        budget.requested();
     
     task1 = runFetch(std::move(c));
     pool.add(task1);
     
     io::task<bson::Object>* t = pool.wait(std::min(retransmit, timeout));
+    bool hedge = !t; // as opposed to retrying a failed request
     if ((!t || !t->succeeded()) && retransmit.finite()) {
         Connection c2 = pickBackend();
+        if (c2.exists() && hedge && !budget.tryRetransmit()) {
+            DEBUG(1) << "Not retransmitting config request: retransmit budget exhausted";
+            c2.release();
+        }
         if (c2.exists()) {
             DEBUG(1) << "Retransmitting config request to another server";
             task2 = runFetch(std::move(c2));
@@ -463,7 +685,11 @@ bson::Object ConfigHolder::fetchConfig()
     
     while (!pool.empty()) {
         t = pool.wait(timeout);
-        if (t && t->succeeded()) {
+        if (!t)
+            break;
+        if (t->succeeded()) {
+            if (t == &task2 && hedge)
+                budget.won();
             bson::Object cfg = t->get();
             DEBUG(3) << "Read config: " << cfg;
             return cfg;
@@ -477,6 +703,27 @@ bson::Object ConfigHolder::fetchConfig()
     }
 }
 
+bson::Object ConfigHolder::fetchConfig(const std::vector<std::string>& hotCollections)
+{
+    return fetch([hotCollections](io::stream& s) { return readconf(s, hotCollections); });
+}
+
+bson::Array ConfigHolder::fetchChunks(const Namespace& ns)
+{
+    bson::Object ret = fetch([ns](io::stream& s) {
+        return bson::object("chunks", readTable(s, Namespace("config.chunks"), "ns", ns.ns()));
+    });
+    return ret["chunks"].as<bson::Array>();
+}
+
+Config::ChunkLoader ConfigHolder::chunkLoader()
+{
+    if (options().lazyChunks)
+        return [this](const Namespace& ns) { return fetchChunks(ns); };
+    else
+        return Config::ChunkLoader();
+}
+
 ConfigHolder::ConfigHolder(const std::string& connstr):
     connstr_(connstr)
 {
@@ -485,12 +732,19 @@ ConfigHolder::ConfigHolder(const std::string& connstr):
 
     configShard_ = ShardPool::instance().get("config", connstr_);
 
-    bson::Object cache = g_cache->get("shard_config");
-    if (!cache.empty()) {
+    std::shared_ptr<MappedConfig> cache = g_cache->shardConfig();
+    if (cache) {
         INFO() << "Using shard config cache";
-        config_ = std::make_shared<Config>(configShard_, cache);
-        if (!config_.get()) {
-            INFO() << "Cannot use shard config cache";
+        try {
+            // The cache may lack chunks of some collections (or have them damaged);
+            // those are fetched from config servers regardless of `--lazy-chunks'.
+            config_ = std::make_shared<Config>(configShard_, cache->meta(), [this, cache](const Namespace& ns) {
+                bson::Array chunks = cache->chunks(ns.ns());
+                return chunks.empty() ? fetchChunks(ns) : chunks;
+            });
+        }
+        catch (std::exception& e) {
+            INFO() << "Cannot use shard config cache: " << e.what();
         }
     }
     
@@ -499,24 +753,30 @@ ConfigHolder::ConfigHolder(const std::string& connstr):
 
 void ConfigHolder::update()
 {
-    DEBUG(1) << "Fetching shard config";
-    bson::Object confBson = fetchConfig();
-
     std::shared_ptr<Config> current;
     {
         std::unique_lock<io::sys::mutex> lock(mutex_);
         current = config_;
     }
 
-    if (!current || current->bson() != confBson) {
+    std::vector<std::string> hot;
+    if (options().lazyChunks && current)
+        hot = current->hotCollections(options().chunkIdleTimeout);
+
+    DEBUG(1) << "Fetching shard config";
+    bson::Object confBson = fetchConfig(hot);
+
+    if (!current || current->digest() != Config::digest(confBson)) {
         {
-            std::shared_ptr<Config> conf = std::make_shared<Config>(shard(), confBson);
+            std::shared_ptr<Config> conf = std::make_shared<Config>(shard(), confBson, chunkLoader());
+            if (current)
+                conf->inheritAccessTimes(*current);
             DEBUG(1) << "Applying shard config";
             std::unique_lock<io::sys::mutex> lock(mutex_);
             config_ = conf;
             NOTICE() << "Shard config changed";
         }
-        g_cache->put("shard_config", confBson);
+        g_cache->putShardConfig(confBson);
     } else {
         DEBUG(1) << "Shard config unchanged";
     }
@@ -527,6 +787,8 @@ void ConfigHolder::keepUpdating()
     for (;;) {
         try {
             update();
+            if (options().lazyChunks)
+                get()->evictColdCollections(options().chunkIdleTimeout);
         }
         catch (std::exception& e) {
             WARN() << "Cannot update config: " << e.what();
@@ -36,14 +36,22 @@
 #include <bson/bson.h>
 #include <mutex>
 #include <vector>
+#include <unordered_map>
 #include <string>
 #include <memory>
+#include <functional>
+#include <atomic>
 #include <stdexcept>
 
 class Shard;
 
 class Config {
 public:
+    
+    struct VersionedShard {
+        std::shared_ptr<Shard> shard;
+        ChunkVersion version;
+    };
         
     class Chunk {
     public:
@@ -52,7 +60,7 @@ public:
         /// Constructs a primary shard containing all possible key values.
         explicit Chunk(Namespace ns, std::string shard);
         
-        void link(Config& conf);
+        void link(const Config& conf);
         
         const Namespace& ns() const { return ns_; }
         const ChunkVersion& version() const { return version_; }
@@ -64,6 +72,7 @@ public:
         bool contains(const bson::Object& key) const { return (min_.empty() || key >= min_) && (max_.empty() || key < max_); }
         
         void setVersion(ChunkVersion v) { version_ = std::move(v); }
+        void setBounds(bson::Object min, bson::Object max) { min_ = std::move(min); max_ = std::move(max); }
         
     private:
         Namespace ns_;
@@ -77,7 +86,8 @@ public:
 
     class Collection {
     public:
-        typedef std::vector<Chunk>::const_iterator const_iterator;
+        typedef std::vector<Chunk> Chunks;
+        typedef Chunks::const_iterator const_iterator;
         
         explicit Collection(const bson::Object& obj);
         void link(Config& conf);
@@ -86,15 +96,54 @@ public:
         bool isDropped() const { return isDropped_; }
         const bson::Object& shardingKey() const { return shardingKey_; }
         
-        const_iterator begin() const { return range_.first; }
-        const_iterator end() const { return range_.second; }
+        /// Returns all chunks of the collection, sorted by their lower bounds.
+        /// If chunks have not been loaded yet (see `--lazy-chunks'),
+        /// fetches them from config servers.
+        std::shared_ptr<const Chunks> chunks() const;
+        
+        /// Returns distinct shards holding chunks of the collection,
+        /// along with the data version on each shard.
+        std::shared_ptr<const std::vector<VersionedShard>> shards() const;
+        
+        bool isLoaded() const;
+        SteadyClock::time_point lastAccess() const { return SteadyClock::time_point(SteadyClock::duration(state_->lastAccess)); }
+        void touch(SteadyClock::time_point tp) const { state_->lastAccess = tp.time_since_epoch().count(); }
+        
+        /// Forgets chunks of the collection; they will be re-fetched upon next access.
+        void evict() const;
+        
+    private /*methods*/:
+        struct Routing {
+            Chunks chunks;
+            std::vector<VersionedShard> shards;
+            bson::Array bounds; // storage for bounds of all chunks
+        };
+        
+        std::shared_ptr<const Routing> routing() const;
+        std::shared_ptr<const Routing> load(const bson::Array& chunks) const;
+        
+    private /*fields*/:
+        struct State {
+            std::shared_ptr<const Routing> routing; // accessed atomically
+            std::atomic<SteadyClock::rep> lastAccess { 0 };
+            
+            // Only one request fetches chunks of a collection;
+            // others wait for its result.
+            io::mutex mutex;
+            io::condition_variable cond;
+            bool loading = false;
+            uint64_t attempts = 0;
+            std::exception_ptr error; // of the last attempt
+        };
+        
+        friend class Config;
         
-    private:
         const Config* conf_;
         Namespace ns_;
         bool isDropped_;
         bson::Object shardingKey_;
-        std::pair<const_iterator, const_iterator> range_;
+        bson::ObjectID epoch_;
+        std::unique_ptr<State> state_;
     };
 
     
@@ -117,24 +166,53 @@ public:
     };    
     
     
-    Config(std::shared_ptr<Shard> configShard, const bson::Object& obj);
+    /// Fetches chunks of the specified collection from config servers.
+    typedef std::function<bson::Array(const Namespace&)> ChunkLoader;
+    
+    /// Constructs a config from its BSON representation. If `loader' is specified,
+    /// only chunks present in `obj' are loaded immediately; chunks of other
+    /// collections are fetched with `loader' upon first access.
+    Config(std::shared_ptr<Shard> configShard, const bson::Object& obj, ChunkLoader loader = ChunkLoader());
     ~Config();
     
-    const ::bson::Object& bson() const { return bson_; }
+    /// Returns a digest of BSON representation the config has been constructed from.
+    const std::string& digest() const { return digest_; }
+    static std::string digest(const ::bson::Object& obj);
+    
+    struct Footprint {
+        size_t collections = 0;
+        size_t loadedCollections = 0;
+        size_t chunks = 0;
+        size_t bytes = 0;
+    };
+    
+    /// Returns an estimate of memory occupied by routing tables.
+    Footprint footprint() const;
     
     std::shared_ptr<Shard> shard(const std::string& name) const;
     const Database* database(const std::string& name) const { return databases_.findPtr(name); }
-    const Collection* collection(const Namespace& ns) const { return collections_.findPtr(ns.ns()); }
-    
-    const SortedVector<Chunk, std::pair<std::string, bson::Object> >& chunks() const { return chunks_; }
+    const Collection* collection(const Namespace& ns) const
+    {
+        if (!ns.id())
+            return ns.empty() ? nullptr : collections_.findPtr(ns.ns());
+        auto i = collectionsByID_.find(ns.id());
+        return i != collectionsByID_.end() ? i->second : nullptr;
+    }
     
     const SortedVector<Database, std::string>& databases() const { return databases_; }
-    std::vector< std::shared_ptr<Shard> > shards() const;
+    const SortedVector<Collection, std::string>& collections() const { return collections_; }
     
-    struct VersionedShard {
-        std::shared_ptr<Shard> shard;
-        ChunkVersion version;
-    };
+    /// Returns a list of collections whose chunks are loaded
+    /// and were accessed not earlier than `idle' ago.
+    std::vector<std::string> hotCollections(std::chrono::milliseconds idle) const;
+    
+    /// Forgets chunks of all collections not accessed for `idle'.
+    void evictColdCollections(std::chrono::milliseconds idle) const;
+    
+    /// Copies last access times of collections from `prev' config.
+    void inheritAccessTimes(const Config& prev) const;
+    
+    std::vector< std::shared_ptr<Shard> > shards() const;
 
     /// Returns a list of shards containing collection `ns', along with
     /// the data version on each shard.
@@ -147,12 +225,13 @@ public:
     SteadyClock::time_point createdAt() const { return createdAt_; }
 
 private:
-    bson::Object bson_;
+    std::string digest_;
     std::shared_ptr<Shard> configShard_;
     SortedVector<std::pair< std::string, std::shared_ptr<Shard> >, std::string> shards_;
-    SortedVector<Chunk, std::pair<std::string, bson::Object> > chunks_;
     SortedVector<Collection, std::string> collections_;
+    std::unordered_map<uint32_t, const Collection*> collectionsByID_;
     SortedVector<Database, std::string> databases_;
+    ChunkLoader loader_;
     SteadyClock::time_point createdAt_;
     
     Config(const Config&) = delete;
@@ -185,7 +264,10 @@ public:
     std::shared_ptr<Shard> shard() const { return configShard_; }
 
 private /*methods*/:
-    bson::Object fetchConfig();
+    bson::Object fetch(std::function<bson::Object(io::stream&)> reader);
+    bson::Object fetchConfig(const std::vector<std::string>& hotCollections);
+    bson::Array fetchChunks(const Namespace& ns);
+    Config::ChunkLoader chunkLoader();
     void keepUpdating();
 
 private /*fields*/:
@@ -75,6 +75,7 @@ DEFINE_ERROR(ShardConfigStale,     BackendClientError);
 DEFINE_ERROR(NotMaster,            BackendClientError);
 DEFINE_ERROR(PermanentFailure,     BackendClientError);
 DEFINE_ERROR(ConnectivityError,    BackendClientError);
+DEFINE_ERROR(Throttled,            BackendClientError); // too many connections being established
 
 DEFINE_ERROR(NoSuitableBackend,    Error);
 
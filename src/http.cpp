@@ -65,13 +65,23 @@ void showShards(std::unordered_map<std::string, std::string>& headers, std::ostr
              << "<th>Backend</th>"
              << "<th>Status</th>"
              << "<th>Lag</th>"
+             << "<th>Load</th>"
+             << "<th>Ejections</th>"
              << "<th>Address</th>"
-             << "<th>RTT</th></tr>";
+             << "<th>RTT</th>"
+             << "<th>Connections</th>"
+             << "<th>Waits</th></tr>";
 
     try {
         std::shared_ptr<Config> conf = g_config->get();
         for (const std::shared_ptr<Shard>& shard: conf->shards()) {
-            response << "<tr class='shard'><td colspan='5'>" << shard->id() << "</td></tr>";
+            response << "<tr class='shard'><td colspan='9'>" << shard->id();
+            RetransmitBudget::Stats retransmits = shard->retransmitBudget().stats();
+            if (retransmits.sent || retransmits.suppressed) {
+                response << " (retransmits: " << retransmits.sent << " sent, " << retransmits.won << " won, "
+                         << retransmits.suppressed << " suppressed)";
+            }
+            response << "</td></tr>";
             for (const std::unique_ptr<Backend>& backend: shard->backends()) {
                 bool first = true;
                 for (const std::unique_ptr<Endpoint>& endpt: backend->endpoints()) {
@@ -84,21 +94,76 @@ void showShards(std::unordered_map<std::string, std::string>& headers, std::ostr
                             response << "<td>" << std::chrono::duration_cast<std::chrono::seconds>(lag).count() << " s</td>";
                         else
                             response << "<td>&mdash;</td>";
+                        
+                        Backend::ServerLoad load = backend->load();
+                        response << "<td>" << load.queued << " queued, " << load.active << " active, "
+                                 << static_cast<int64_t>(load.opsPerSec) << " op/s";
+                        if (load.queueDelay() != std::chrono::microseconds::zero())
+                            response << " (" << std::chrono::duration_cast<std::chrono::milliseconds>(load.queueDelay()).count() << " ms wait)";
+                        response << "</td>";
+                        
+                        const OutlierDetector& outlier = backend->outlier();
+                        OutlierDetector::State state = outlier.state();
+                        response << "<td>";
+                        if (state == OutlierDetector::State::EJECTED)
+                            response << "EJECTED for " << std::chrono::duration_cast<std::chrono::seconds>(outlier.ejectedFor()).count() << " s";
+                        else if (state == OutlierDetector::State::RECOVERING)
+                            response << "RECOVERING (" << static_cast<int>(outlier.share() * 100) << "% of reads)";
+                        else if (outlier.ejections())
+                            response << "active";
+                        else
+                            response << "&mdash;";
+                        if (outlier.ejections())
+                            response << ", " << outlier.ejections() << " total";
+                        if (outlier.consecutiveErrors())
+                            response << ", " << outlier.consecutiveErrors() << " errors in a row";
+                        response << "</td>";
                         first = false;
                     } else {
-                        response << "<tr><td class='leftspacer'>&nbsp;</td><td></td><td></td><td></td>";
+                        response << "<tr><td class='leftspacer'>&nbsp;</td><td></td><td></td><td></td><td></td><td></td>";
                     }
                     response << "<td>" << endpt->addr() << "</td><td>";
-                    if (endpt->alive())
+                    if (endpt->alive()) {
                         response << std::chrono::duration_cast<std::chrono::milliseconds>(endpt->roundtrip()).count() << " ms";
-                    else
+                        const LatencyEstimator& latency = endpt->latency();
+                        if (!latency.empty()) {
+                            response << " (requests: "
+                                     << std::chrono::duration_cast<std::chrono::milliseconds>(latency.average()).count() << " ms avg, "
+                                     << std::chrono::duration_cast<std::chrono::milliseconds>(latency.percentile(0.95)).count() << " ms p95)";
+                        }
+                    } else {
                         response << "DEAD";
+                    }
+                    
+                    Endpoint::PoolStats pool = endpt->poolStats();
+                    response << "</td><td>" << (pool.open - pool.idle) << " busy, " << pool.idle << " idle"
+                             << " (" << pool.created << " opened, " << pool.reused << " reused, " << pool.reaped << " stale"
+                             << (pool.connecting ? ", " + std::to_string(pool.connecting) + " connecting" : std::string())
+                             << (pool.throttled ? ", " + std::to_string(pool.throttled) + " throttled" : std::string()) << ")</td><td>";
+                    if (pool.waits) {
+                        response << pool.waits << " (" << pool.waitTimeouts << " timed out, "
+                                 << std::chrono::duration_cast<std::chrono::milliseconds>(pool.waitTime).count() / pool.waits << " ms avg)";
+                        if (pool.waiting)
+                            response << ", " << pool.waiting << " waiting";
+                    } else {
+                        response << "&mdash;";
+                    }
                     response << "</td></tr>";
                 }
             }
         }
 
         response << "</table>";
+        
+        Config::Footprint fp = conf->footprint();
+        response << "<h1>Shard config</h1><table>"
+                 << "<tr><td>Digest</td><td>" << conf->digest() << "</td></tr>"
+                 << "<tr><td>Age</td><td>"
+                 << std::chrono::duration_cast<std::chrono::seconds>(SteadyClock::now() - conf->createdAt()).count() << " s</td></tr>"
+                 << "<tr><td>Collections</td><td>" << fp.collections << " (" << fp.loadedCollections << " loaded)</td></tr>"
+                 << "<tr><td>Chunks</td><td>" << fp.chunks << "</td></tr>"
+                 << "<tr><td>Memory</td><td>" << (fp.bytes + 1023) / 1024 << " KiB</td></tr>"
+                 << "</table>";
     }
     catch (const errors::NoShardConfig&) {
         response << "<span style='color: red'>No shard config yet</span>";
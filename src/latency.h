@@ -0,0 +1,127 @@
+/**
+ * latency.h -- passive latency estimation
+ *
+ * This file is part of mongoz, a more sound implementation
+ * of mongodb sharding server.
+ *
+ * Copyright (c) 2016 YANDEX LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "clock.h"
+#include <syncio/syncio.h>
+#include <chrono>
+#include <mutex>
+#include <cmath>
+#include <algorithm>
+
+/// Estimates latency of requests from durations of actually completed ones:
+/// an exponentially weighted moving average, and percentiles taken from
+/// a decaying log-scale histogram (so old samples gradually fade away).
+class LatencyEstimator {
+public:
+    typedef std::chrono::microseconds Duration;
+    
+    void add(Duration d)
+    {
+        double us = std::max<double>(d.count(), 0);
+        SteadyClock::time_point now = SteadyClock::now();
+        
+        static const double ALPHA = 0.1;
+        static const double DECAY_SAMPLES = 1000;
+        static const std::chrono::seconds DECAY_PERIOD(10);
+        
+        std::unique_lock<io::sys::mutex> lock(mutex_);
+        ewma_ = seeded_ ? ewma_ + ALPHA * (us - ewma_) : us;
+        seeded_ = true;
+        
+        if (total_ >= DECAY_SAMPLES || now - lastDecay_ >= DECAY_PERIOD) {
+            for (double& c: counts_)
+                c /= 2;
+            total_ /= 2;
+            lastDecay_ = now;
+        }
+        counts_[bucket(us)] += 1;
+        total_ += 1;
+        last_ = now;
+    }
+    
+    bool empty() const
+    {
+        std::unique_lock<io::sys::mutex> lock(mutex_);
+        return !seeded_;
+    }
+    
+    /// Number of samples percentiles are based on (with decay applied).
+    double weight() const
+    {
+        std::unique_lock<io::sys::mutex> lock(mutex_);
+        return total_;
+    }
+    
+    /// Whether there has been a sample since `t'.
+    bool hasSamplesSince(SteadyClock::time_point t) const
+    {
+        std::unique_lock<io::sys::mutex> lock(mutex_);
+        return total_ != 0 && last_ >= t;
+    }
+    
+    Duration average() const
+    {
+        std::unique_lock<io::sys::mutex> lock(mutex_);
+        return Duration(static_cast<Duration::rep>(ewma_));
+    }
+    
+    /// Returns an upper estimate of p-th quantile (0 < p < 1),
+    /// or zero if there were no samples.
+    Duration percentile(double p) const
+    {
+        std::unique_lock<io::sys::mutex> lock(mutex_);
+        double target = total_ * p;
+        double seen = 0;
+        for (size_t i = 0; i != BUCKETS; ++i) {
+            seen += counts_[i];
+            if (seen > 0 && seen >= target)
+                return Duration(static_cast<Duration::rep>(upperBound(i)));
+        }
+        return Duration(0);
+    }
+    
+private /*methods*/:
+    // Buckets grow geometrically, by 2^(1/3) each, up to about a minute.
+    static const size_t PER_OCTAVE = 3;
+    static const size_t BUCKETS = 26 * PER_OCTAVE;
+    
+    static size_t bucket(double us)
+        { return std::min<size_t>(static_cast<size_t>(PER_OCTAVE * std::log2(us + 1)), BUCKETS - 1); }
+    static double upperBound(size_t i)
+        { return std::exp2(static_cast<double>(i + 1) / PER_OCTAVE) - 1; }
+    
+private /*fields*/:
+    mutable io::sys::mutex mutex_;
+    double ewma_ = 0;
+    double counts_[BUCKETS] = {};
+    double total_ = 0;
+    bool seeded_ = false;
+    SteadyClock::time_point last_;
+    SteadyClock::time_point lastDecay_;
+};
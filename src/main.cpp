@@ -31,6 +31,7 @@
 #include "options.h"
 #include "auth.h"
 #include "cache.h"
+#include "read.h"
 #include "utility.h"
 #include <syncio/syncio.h>
 #include <string>
@@ -339,6 +340,8 @@ int main(int argc, char** argv)
 
             NOTICE() << "starting mongoz";
             
+            HedgeSchedule::configured(); // report malformed schedule right away
+            
 #ifdef CPUPROFILE
             if (!debugOptions().profileCpu.empty())
                 ProfilerStart(debugOptions().profileCpu.c_str());
@@ -46,6 +46,12 @@ Status check()
                 + std::to_string(std::chrono::duration_cast<std::chrono::minutes>(SteadyClock::now() - config->createdAt()).count())
                 + " min"));
         }
+        
+        Config::Footprint fp = config->footprint();
+        if (options().monitorConfigMemory && fp.bytes > options().monitorConfigMemory * 1024 * 1024) {
+            status.merge(monitoring::Status::warning("shard config occupies "
+                + std::to_string(fp.bytes / 1024 / 1024) + " MiB"));
+        }
     } else {
         status.merge(monitoring::Status::critical("no config available"));
         status.merge(g_config->shard()->status());
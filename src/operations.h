@@ -33,7 +33,7 @@
 #include <bson/bson11.h>
 #include <atomic>
 
-class Connection;
+class Endpoint;
 
 class DataSource {
 public:
@@ -73,10 +73,10 @@ public:
     bool isClosed() const { return closed_; }
     
     /// Used for debugging and testing.
-    std::vector<const Connection*> usedConnections() const
+    std::vector<const Endpoint*> usedEndpoints() const
     {
-        std::vector<const Connection*> ret;
-        reportConnections(ret);
+        std::vector<const Endpoint*> ret;
+        reportEndpoints(ret);
         return ret;
     }
 
@@ -89,7 +89,7 @@ private /*methods*/:
         return ++g_id;
     }
     
-    virtual void reportConnections(std::vector<const Connection*>&) const {}
+    virtual void reportEndpoints(std::vector<const Endpoint*>&) const {}
     
     virtual void dump(std::ostream& out) const
     {
@@ -54,6 +54,21 @@
     option( std::chrono::milliseconds,   maxReplLag,             std::chrono::milliseconds::max(), \
         "ignore replicas whose lag exceeds specified value" ) \
     \
+    option( size_t,                      serverLoadWeight,       100, \
+        "weight (in percent) of server-side queueing in replica selection" ) \
+    \
+    option( size_t,                      outlierErrors,          5, \
+        "eject a backend after N consecutive failures" ) \
+    \
+    option( size_t,                      outlierLatencyFactor,   5, \
+        "eject a backend N times slower than the median one in its shard" ) \
+    \
+    option( std::chrono::milliseconds,   outlierEjectTime,       30000, \
+        "base period for ejected backends to be left without reads" ) \
+    \
+    option( size_t,                      outlierMaxEjected,      50, \
+        "never eject more than N percent of backends of a shard" ) \
+    \
     brk() \
     \
     option( std::chrono::milliseconds,   readTimeout,            std::chrono::milliseconds::max(), \
@@ -65,6 +80,27 @@
     option( std::chrono::milliseconds,   readRetransmit,         std::chrono::milliseconds::max(), \
         "default retransmit interval for queries" ) \
     \
+    option( size_t,                      readRetransmitPercentile, 0, \
+        "retransmit queries lasting longer than N-th percentile of recent ones" ) \
+    \
+    option( std::chrono::milliseconds,   readRetransmitMin,      5, \
+        "lower bound for adaptive retransmit interval" ) \
+    \
+    option( std::chrono::milliseconds,   readRetransmitMax,      1000, \
+        "upper bound for adaptive retransmit interval" ) \
+    \
+    option( std::string,                 readHedgeSchedule,      std::string(), \
+        "send slow queries to more replicas after specified delays" ) \
+    \
+    option( std::string,                 hedgeSpreadTag,         std::string(), \
+        "retransmit to replicas differing in specified tag first" ) \
+    \
+    option( size_t,                      retransmitBudget,       5, \
+        "retransmit at most N percent of requests to a shard" ) \
+    \
+    option( std::chrono::milliseconds,   retransmitGrace,        1000, \
+        "let the losing request complete in background to reuse its connection" ) \
+    \
     option( std::chrono::milliseconds,   writeRetransmit,        std::chrono::milliseconds::max(), \
         "default retransmit interval for inserts/updates/deletes" ) \
     \
@@ -79,6 +115,12 @@
     option( std::chrono::milliseconds,   pingFailInterval,       2000, \
         "ping interval for dead backends" ) \
     \
+    option( std::chrono::milliseconds,   pingStatusInterval,     30000, \
+        "interval of full status refresh for backends with no changes" ) \
+    \
+    option( std::chrono::milliseconds,   topologyAwait,          10000, \
+        "let replica set members hold isMaster until their state changes" ) \
+    \
     brk() \
     \
     option( std::chrono::milliseconds,   confTimeout,            1000, \
@@ -90,6 +132,12 @@
     option( std::chrono::milliseconds,   confInterval,           10000, \
         "poll interval for config servers" ) \
     \
+    option( bool,                        lazyChunks,             false, \
+        "fetch chunks of a collection upon its first access" ) \
+    \
+    option( std::chrono::milliseconds,   chunkIdleTimeout,       600000, \
+        "forget chunks of collections not accessed for specified time" ) \
+    \
     brk() \
     \
     option( std::chrono::milliseconds,   monitorNoPrimary,       std::chrono::milliseconds::max(), \
@@ -98,6 +146,9 @@
     option( std::chrono::milliseconds,   monitorConfigAge,       std::chrono::milliseconds::max(), \
         "maximal shard config age before triggering an event" ) \
     \
+    option( size_t,                      monitorConfigMemory,    0, \
+        "maximal memory (in MiB) occupied by shard config before triggering an event" ) \
+    \
     brk() \
     \
     option( bool,                        globalCursors,          false, \
@@ -106,6 +157,27 @@
     option( size_t,                      connPoolSize,           std::thread::hardware_concurrency(), \
         "maintain N persistent connection per backend" ) \
     \
+    option( size_t,                      connPoolMin,            0, \
+        "keep at least N connections per backend open" ) \
+    \
+    option( size_t,                      connPoolMax,            std::numeric_limits<size_t>::max(), \
+        "never open more than N connections per backend" ) \
+    \
+    option( std::chrono::milliseconds,   connWaitTimeout,        1000, \
+        "maximal time to wait for a connection if the pool is exhausted" ) \
+    \
+    option( std::chrono::milliseconds,   connIdleTimeout,        60000, \
+        "close pooled connections idle for longer than specified time" ) \
+    \
+    option( size_t,                      connectConcurrency,     16, \
+        "establish at most N connections per backend simultaneously" ) \
+    \
+    option( size_t,                      connectRate,            200, \
+        "establish at most N connections per backend per second" ) \
+    \
+    option( size_t,                      connectQueue,           64, \
+        "fail requests if N requests are already waiting to connect to a backend" ) \
+    \
     option( size_t,                      threads,                std::thread::hardware_concurrency(), \
         "spawn N threads" ) \
     \
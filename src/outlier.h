@@ -0,0 +1,153 @@
+/**
+ * outlier.h -- ejection of misbehaving backends
+ *
+ * This file is part of mongoz, a more sound implementation
+ * of mongodb sharding server.
+ *
+ * Copyright (c) 2016 YANDEX LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "clock.h"
+#include "options.h"
+#include "utility.h"
+#include <syncio/syncio.h>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+
+/// Keeps track of whether a backend is an outlier among members of its shard
+/// (it fails consecutively or is much slower than the others). An outlier is
+/// ejected, i.e. not selected for reads, for `--outlier-eject-time', doubled
+/// for each recent ejection. Afterwards it is let back gradually: it receives
+/// a share of requests growing over another `--outlier-eject-time', and
+/// a single failure in the meantime ejects it again.
+class OutlierDetector {
+public:
+    enum class State { ACTIVE, EJECTED, RECOVERING };
+    
+    /// Registers a failed request; returns the number of consecutive failures.
+    unsigned failed() { return ++consecutiveErrors_; }
+    
+    /// Registers a successful request.
+    void succeeded() { consecutiveErrors_ = 0; }
+    
+    void eject()
+    {
+        SteadyClock::time_point now = SteadyClock::now();
+        std::unique_lock<io::sys::mutex> lock(mutex_);
+        
+        // Each base ejection period spent in service forgives one past ejection.
+        SteadyClock::time_point until = ejectedUntil();
+        if (multiplier_ && now > until) {
+            unsigned forgiven = (now - until) / baseTime();
+            multiplier_ -= std::min(multiplier_, forgiven);
+        }
+        
+        static const unsigned MAX_DOUBLINGS = 5;
+        std::chrono::milliseconds duration = baseTime() * (1u << std::min(multiplier_, MAX_DOUBLINGS));
+        ++multiplier_;
+        consecutiveErrors_ = 0;
+        ejectedUntil_ = (now + duration).time_since_epoch().count();
+        ++ejections_;
+    }
+    
+    State state(SteadyClock::time_point now = SteadyClock::now()) const
+    {
+        if (!ejections_)
+            return State::ACTIVE;
+        SteadyClock::time_point until = ejectedUntil();
+        if (now < until)
+            return State::EJECTED;
+        else if (now < until + baseTime())
+            return State::RECOVERING;
+        else
+            return State::ACTIVE;
+    }
+    
+    /// Share of requests the backend is to receive (from 0 to 1).
+    double share(SteadyClock::time_point now = SteadyClock::now()) const
+    {
+        static const double MIN_SHARE = 0.1;
+        
+        if (!ejections_)
+            return 1;
+        SteadyClock::time_point until = ejectedUntil();
+        if (now < until)
+            return 0;
+        double recovered = std::chrono::duration_cast<std::chrono::duration<double>>(now - until).count()
+            / std::chrono::duration_cast<std::chrono::duration<double>>(baseTime()).count();
+        return std::min(1.0, std::max(MIN_SHARE, recovered));
+    }
+    
+    /// Decides whether the backend can be selected for a request.
+    /// Takes no locks, since it is called for each candidate of each query.
+    bool admits() const
+    {
+        static const size_t RESOLUTION = 1000;
+        double s = share();
+        return s >= 1 || randomIndex(RESOLUTION) < s * RESOLUTION;
+    }
+    
+    /// Returns true (at most once a second) if it's time to compare
+    /// the backend's latency against other members of its shard.
+    bool latencyCheckDue()
+    {
+        static const std::chrono::seconds INTERVAL(1);
+        SteadyClock::rep now = SteadyClock::now().time_since_epoch().count();
+        SteadyClock::rep last = lastLatencyCheck_;
+        return now - last >= SteadyClock::duration(INTERVAL).count()
+            && lastLatencyCheck_.compare_exchange_strong(last, now);
+    }
+    
+    unsigned consecutiveErrors() const { return consecutiveErrors_; }
+    uint64_t ejections() const { return ejections_; }
+    
+    /// Time left until the backend is let back (zero unless ejected).
+    std::chrono::milliseconds ejectedFor() const
+    {
+        if (!ejections_)
+            return std::chrono::milliseconds::zero();
+        SteadyClock::time_point now = SteadyClock::now();
+        SteadyClock::time_point until = ejectedUntil();
+        return now < until ? std::chrono::duration_cast<std::chrono::milliseconds>(until - now) : std::chrono::milliseconds::zero();
+    }
+    
+private /*methods*/:
+    static std::chrono::milliseconds baseTime() { return options().outlierEjectTime; }
+    
+    SteadyClock::time_point ejectedUntil() const
+        { return SteadyClock::time_point(SteadyClock::duration(ejectedUntil_.load())); }
+    
+private /*fields*/:
+    io::sys::mutex mutex_;
+    unsigned multiplier_ = 0;                 // guarded by `mutex_'
+    std::atomic<uint64_t> ejections_ { 0 };
+    std::atomic<unsigned> consecutiveErrors_ { 0 };
+    
+    // Time points are kept as atomic counts, so that admits() takes no locks;
+    // they are only meaningful when compared with SteadyClock::now().
+    std::atomic<SteadyClock::rep> ejectedUntil_ { 0 };      // meaningless unless ejected at least once
+    std::atomic<SteadyClock::rep> lastLatencyCheck_ { 0 };
+};
@@ -30,41 +30,79 @@
 #include "error.h"
 #include <syncio/syncio.h>
 #include <type_traits>
+#include <functional>
+#include <chrono>
 #include <cerrno>
 
 
+/// A set of tasks racing for the same result. Tasks still running when
+/// the pool is destroyed (i.e. the ones which lost the race) are cancelled,
+/// unless drainLosers() has been called.
 template<class T>
 class TaskPool {
 public:
+    TaskPool() {}
+    TaskPool(const TaskPool&) = delete;
+    TaskPool& operator = (const TaskPool&) = delete;
+    ~TaskPool() { abandon(); }
+    
     void add(io::task<T>& task) { tasks_.push_back(&task); }
     
-    io::task<T>* wait(io::timeout timeout)
+    /// Makes abandoned tasks complete in background for at most `grace'
+    /// and passes their results to `recover', so that resources held by them
+    /// (such as connections) are not wasted. Tasks not completed in time
+    /// are cancelled.
+    void drainLosers(std::chrono::milliseconds grace, std::function<void(T)> recover = std::function<void(T)>())
     {
-        for (;;) {
-            io::wait_any(tasks_, timeout);
-            auto i = std::find_if(tasks_.begin(), tasks_.end(), [](io::impl::TaskBase* t) { return t->completed(); });
-            if (i == tasks_.end())
-                return 0;
-            
-            io::task<T>& t = *static_cast<io::task<T>*>(*i);
-            *i = tasks_.back();
-            tasks_.pop_back();
+        grace_ = grace;
+        recover_ = std::move(recover);
+    }
+    
+    /// Gives up on all the tasks still in the pool.
+    void abandon()
+    {
+        for (io::impl::TaskBase* p: tasks_) {
+            io::task<T>& t = *static_cast<io::task<T>*>(p);
+            if (grace_ == std::chrono::milliseconds::zero()) {
+                t.cancel(); // without waiting for completion, so that all tasks unwind at once
+                continue;
+            }
             
-            if (t.succeeded())
-                return &t;
-            else if (t.failed()) {
-                try { t.get(); }
-                catch (errors::BackendClientError&) { return &t; }
-                catch (std::exception&) {
-                    if (tasks_.empty())
-                        return &t;
+            std::function<void(T)> recover = recover_;
+            std::chrono::milliseconds grace = grace_;
+            io::spawn([recover, grace](io::task<T> t) {
+                io::wait(t, grace);
+                if (t.succeeded() && recover) {
+                    try { recover(t.get()); }
+                    catch (std::exception&) {}
                 }
-            }
+                // otherwise the task is cancelled upon destruction
+            }, std::move(t)).detach();
         }
+        tasks_.clear();
+    }
+    
+    /// Removes the first task to complete from the pool and returns it,
+    /// whether it has succeeded or failed (so that the caller can account
+    /// for the failure and decide whether to wait for the rest).
+    /// Returns NULL on timeout.
+    io::task<T>* wait(io::timeout timeout)
+    {
+        io::wait_any(tasks_, timeout);
+        auto i = std::find_if(tasks_.begin(), tasks_.end(), [](io::impl::TaskBase* t) { return t->completed(); });
+        if (i == tasks_.end())
+            return 0;
+        
+        io::task<T>& t = *static_cast<io::task<T>*>(*i);
+        *i = tasks_.back();
+        tasks_.pop_back();
+        return &t;
     }
 
     bool empty() const { return tasks_.empty(); }
     
 private:
     std::vector<io::impl::TaskBase*> tasks_;
+    std::chrono::milliseconds grace_ { 0 };
+    std::function<void(T)> recover_;
 };
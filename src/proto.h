@@ -31,7 +31,11 @@
 #include "log.h"
 #include "utility.h"
 #include <vector>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
+#include <cstring>
 #include <stdint.h>
 #include <syncio/syncio.h>
 #include <bson/bson11.h>
@@ -47,31 +51,140 @@ enum class Opcode: int32_t {
     KILL_CURSORS  = 2007
 };
 
+/// A fully qualified collection name. Namespaces are interned: each distinct
+/// name is stored once in a process-wide table and gets a small stable ID,
+/// so namespaces are cheap to copy, compare and use as keys.
+/// Interned names are never freed; once the table holds `MAX_INTERNED'
+/// names (say, a client makes up random ones), further namespaces
+/// are allocated on their own and get zero ID.
 class Namespace {
 public:
-    Namespace() {}
+    Namespace(): entry_(&emptyEntry()) {}
     
-    Namespace(std::string db, std::string coll):
-        db_(std::move(db)), coll_(std::move(coll)), ns_(db_ + "." + coll_) {}
+    Namespace(const std::string& db, const std::string& coll):
+        entry_(intern(View { db.data(), db.size(), coll.data(), coll.size() })) {}
     
-    explicit Namespace(std::string ns): ns_(std::move(ns))
+    explicit Namespace(const std::string& ns)
     {
-        auto dot = ns_.find('.');
+        auto dot = ns.find('.');
         REQUIRE(dot != std::string::npos);
-        db_ = ns_.substr(0, dot);
-        coll_ = ns_.substr(dot + 1);
+        entry_ = intern(View { ns.data(), dot, ns.data() + dot + 1, ns.size() - dot - 1 });
     }
     
-    const std::string& db() const { return db_; }
-    const std::string& collection() const { return coll_; }
-    const std::string& ns() const { return ns_; }
+    const std::string& db() const { return entry_->db; }
+    const std::string& collection() const { return entry_->coll; }
+    const std::string& ns() const { return entry_->ns; }
     
-    bool empty() const { return ns_.empty(); }
+    /// Returns an ID of the namespace, unique within the process
+    /// (0 for an empty namespace or one which has not been interned).
+    uint32_t id() const { return entry_->id; }
+    
+    bool empty() const { return entry_->ns.empty(); }
+    
+    bool operator == (const Namespace& ns) const
+    {
+        return entry_ == ns.entry_ || ((!entry_->id || !ns.entry_->id) && entry_->ns == ns.entry_->ns);
+    }
+    bool operator != (const Namespace& ns) const { return !(*this == ns); }
     
     friend std::ostream& operator << (std::ostream& out, const Namespace& ns) { return out << ns.ns(); }
 
-private:
-    std::string db_, coll_, ns_;
+private /*types*/:
+    struct Entry {
+        uint32_t id;
+        std::string db, coll, ns;
+    };
+    
+    /// Database and collection names, referring to somebody else's storage.
+    struct View {
+        const char* db;
+        size_t dbSize;
+        const char* coll;
+        size_t collSize;
+        
+        bool operator == (const View& v) const
+        {
+            return dbSize == v.dbSize && collSize == v.collSize
+                && !memcmp(db, v.db, dbSize) && !memcmp(coll, v.coll, collSize);
+        }
+    };
+    
+    struct Hash {
+        size_t operator()(const View& v) const
+        {
+            // FNV-1a over `db.coll'
+            size_t h = 14695981039346656037ull;
+            auto mix = [&h](const char* p, size_t n) {
+                for (const char* pe = p + n; p != pe; ++p)
+                    h = (h ^ static_cast<unsigned char>(*p)) * 1099511628211ull;
+            };
+            mix(v.db, v.dbSize);
+            mix(".", 1);
+            mix(v.coll, v.collSize);
+            return h;
+        }
+    };
+    
+    /// Keys refer to names stored in entries themselves.
+    typedef std::unordered_map<View, const Entry*, Hash> Map;
+    
+private /*fields*/:
+    static const size_t MAX_INTERNED = 65536;
+    
+    std::shared_ptr<const Entry> own_; // for namespaces not interned (initialized before `entry_')
+    const Entry* entry_;
+    
+private /*methods*/:
+    static const Entry& emptyEntry() { static const Entry e { 0, {}, {}, {} }; return e; }
+    
+    static View view(const Entry& e) { return View { e.db.data(), e.db.size(), e.coll.data(), e.coll.size() }; }
+    
+    const Entry* intern(const View& v)
+    {
+        // Interned entries are never freed, so each thread remembers the ones
+        // it has come across and only consults the global table on a miss.
+        static thread_local Map seen;
+        auto i = seen.find(v);
+        if (i != seen.end())
+            return i->second;
+        
+        struct Table {
+            io::sys::shared_mutex mutex;
+            std::vector< std::unique_ptr<Entry> > entries;
+            Map index;
+        };
+        static Table t;
+        
+        const Entry* e = 0;
+        {
+            io::shared_lock<io::sys::shared_mutex> lock(t.mutex);
+            auto j = t.index.find(v);
+            if (j != t.index.end())
+                e = j->second;
+        }
+        
+        if (!e) {
+            std::string db(v.db, v.dbSize), coll(v.coll, v.collSize);
+            std::unique_ptr<Entry> fresh(new Entry { 0, db, coll, db + "." + coll });
+            
+            std::unique_lock<io::sys::shared_mutex> lock(t.mutex);
+            auto j = t.index.find(v);
+            if (j != t.index.end()) {
+                e = j->second;
+            } else if (t.entries.size() >= MAX_INTERNED) {
+                own_ = std::shared_ptr<const Entry>(std::move(fresh));
+                return own_.get();
+            } else {
+                fresh->id = static_cast<uint32_t>(t.entries.size() + 1);
+                t.entries.push_back(std::move(fresh));
+                e = t.entries.back().get();
+                t.index.insert(std::make_pair(view(*e), e));
+            }
+        }
+        
+        seen.insert(std::make_pair(view(*e), e));
+        return e;
+    }
 };
 
 
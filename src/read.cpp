@@ -36,11 +36,13 @@
 #include "config.h"
 #include <syncio/syncio.h>
 #include <cstdlib>
+#include <numeric>
 
 BackendDatasource::BackendDatasource(std::shared_ptr<Shard> shard, ChunkVersion version, messages::Query msg):
-    shard_(std::move(shard)), version_(std::move(version)), msg_(std::move(msg))
+    shard_(std::move(shard)), version_(std::move(version)), msg_(std::move(msg)),
+    policy_(ReadPolicy::get(msg_.flags, msg_.readPreference()))
 {
-    conn_ = shard_->readOp(msg_.flags, msg_.readPreference());
+    conn_ = shard_->readOp(*policy_);
     if (!conn_.exists())
         throw errors::NoSuitableBackend("no backend suitable for operation on shard " + shard_->id());
     
@@ -48,31 +50,41 @@ BackendDatasource::BackendDatasource(std::shared_ptr<Shard> shard, ChunkVersion
     
     DEBUG(1) << "Requesting initial portition of data";
     talk([this](uint32_t reqID) { return makeQuery(reqID); });
+    detach();
 }
 
 BackendDatasource::~BackendDatasource() {}
 
-void BackendDatasource::doClose()
+void BackendDatasource::detach()
 {
     if (!conn_.exists())
         return;
+    endpt_ = &conn_.endpoint();
+    primary_ = conn_.isPrimary();
+    conn_.release();
+}
+
+void BackendDatasource::doClose()
+{
+    if (!endpt_)
+        return;
 
     if (cursorID_ != 0) {
-        io::task<void> t = io::spawn([this]{
+        // Cursor is killed through endpoint's shared pipelined connection
+        Endpoint& endpt = *endpt_;
+        io::task<void> t = io::spawn([this, &endpt]{
             MsgBuilder b;
             b << (uint32_t) 0 << (uint32_t) 0 << Opcode::KILL_CURSORS
               << (uint32_t) 0 << (uint32_t) 1 << cursorID_;
-            
-            if (!(conn_.stream().write(b.data(), b.size()).flush()))
-                throw io::error("cannot send OP_KILL_CURSORS");
+            const char* data = b.data();
+            endpt.pipe().send(std::vector<char>(data, data + b.size()));
         });
         io::wait(t, 20_ms);
         if (!t.succeeded())
-            conn_ = Connection();
+            DEBUG(1) << "cannot send OP_KILL_CURSORS to " << endpt.addr();
     }
     
-    if (conn_.exists())
-        conn_.release();
+    endpt_ = 0;
 }
 
 std::vector<char> BackendDatasource::makeQuery(uint32_t reqID)
@@ -83,12 +95,8 @@ std::vector<char> BackendDatasource::makeQuery(uint32_t reqID)
     q.batchSize(msg_.nToReturn == 1 ? 1 : 0);
     q.fieldSelector(msg_.fieldSelector);
     
-    if (
-        msg_.readPreference()["mode"].as<std::string>("primary") != "primary"
-        || (msg_.readPreference().empty() && (msg_.flags & messages::Query::SLAVE_OK))
-    ) {
+    if (policy_->slaveOK())
         q.slaveOK();
-    }
     
     return q.data();
 }
@@ -103,13 +111,21 @@ void BackendDatasource::requestMore()
         return b.finish();
     };
     
+    // mongod cursors are not bound to a socket, so any pooled connection
+    // to the same endpoint will do; establish() brings it to the same
+    // authentication and shard version state. It does so before sending
+    // OP_GET_MORE (which is never pipelined with the handshake), so a retried
+    // setShardVersion cannot cause a batch to be fetched and discarded.
+    conn_ = primary_ ? endpt_->getPrimary() : endpt_->getAny();
     talk(makeRequestMore);
+    detach();
 }
 
 namespace {
     struct Reply {
         std::vector<bson::Object> objects;
         uint64_t cursorID;
+        Connection conn;
         
         Reply() {}
         Reply(Reply&&) = default;
@@ -126,24 +142,169 @@ Namespace BackendDatasource::ns() const
         return msg_.ns;
 }
 
-void BackendDatasource::talk(std::function<std::vector<char>(uint32_t)> msgMaker)
+namespace {
+
+/// Returns `p'-th percentile of latency of recent queries to `endpt'
+/// (bounded by `--read-retransmit-min' and `--read-retransmit-max'),
+/// or max() if the endpoint has not served enough queries yet.
+std::chrono::microseconds latencyPercentile(const Endpoint& endpt, double p)
 {
-    bson::Object readPref = msg_.readPreference();
+    static const double MIN_SAMPLES = 20;
+    
+    const LatencyEstimator& latency = endpt.latency();
+    if (latency.weight() < MIN_SAMPLES)
+        return std::chrono::microseconds::max();
     
-    auto readReply = [this](io::stream& s, uint32_t reqID) {
+    std::chrono::microseconds interval = latency.percentile(p);
+    interval = std::max<std::chrono::microseconds>(interval, options().readRetransmitMin);
+    interval = std::min<std::chrono::microseconds>(interval, options().readRetransmitMax);
+    return interval;
+}
+
+/// Returns default retransmit interval for a query to `endpt': either
+/// `--read-retransmit', or (with `--read-retransmit-percentile') the
+/// corresponding percentile of latency of recent queries to the endpoint.
+std::chrono::microseconds retransmitInterval(const Endpoint& endpt)
+{
+    if (options().readRetransmitPercentile) {
+        std::chrono::microseconds interval = latencyPercentile(endpt,
+            std::min<size_t>(options().readRetransmitPercentile, 100) / 100.0);
+        if (interval != std::chrono::microseconds::max())
+            return interval;
+    }
+    
+    if (options().readRetransmit == std::chrono::milliseconds::max())
+        return std::chrono::microseconds::max();
+    return options().readRetransmit;
+}
+
+/// Returns delays after which a query to `endpt' should be retransmitted
+/// to other backends: `retransmitMs' of its read preference if specified,
+/// otherwise `--read-hedge-schedule', otherwise the default retransmit interval.
+std::vector<std::chrono::microseconds> hedgeDelays(
+    const ReadPolicy& policy, const Endpoint& endpt, std::chrono::milliseconds timeout)
+{
+    if (policy.retransmit() != std::chrono::milliseconds::max())
+        return { policy.retransmit() };
+    
+    if (!HedgeSchedule::configured().empty())
+        return HedgeSchedule::configured().delays(endpt, timeout);
+    
+    std::chrono::microseconds interval = retransmitInterval(endpt);
+    if (interval == std::chrono::microseconds::max())
+        return {};
+    return { interval };
+}
+
+/// Puts the connection of a request which has lost the race back into the pool.
+/// The cursor it may have opened is of no use to anyone, so it is killed
+/// over the same connection (OP_KILL_CURSORS has no reply).
+void recoverConnection(Reply r)
+{
+    if (r.cursorID != 0) {
+        MsgBuilder b;
+        b << (uint32_t) 0 << (uint32_t) 0 << Opcode::KILL_CURSORS
+          << (uint32_t) 0 << (uint32_t) 1 << r.cursorID;
+        r.conn.stream().write(b.data(), b.size()).flush();
+        if (!r.conn.stream())
+            return; // connection is closed in destructor
+    }
+    DEBUG(1) << "Reusing connection to " << r.conn.endpoint() << " after a lost race";
+    r.conn.release();
+}
+
+} // namespace
+
+
+HedgeSchedule::HedgeSchedule(const std::string& spec)
+{
+    size_t pos = 0;
+    while (pos < spec.size()) {
+        size_t comma = spec.find(',', pos);
+        if (comma == std::string::npos)
+            comma = spec.size();
+        std::string item;
+        for (char c: spec.substr(pos, comma - pos))
+            if (!isspace(c))
+                item.push_back(c);
+        pos = comma + 1;
+        
+        static const std::string TIMEOUT = "timeout/";
+        
+        size_t digits = 0;
+        if (!item.empty() && item[0] == 'p') {
+            double p = fromString<double>(item.substr(1));
+            if (p <= 0 || p > 100)
+                throw std::runtime_error("bad hedge schedule step `" + item + "': percentile should be within (0, 100]");
+            steps_.push_back(Step { Step::PERCENTILE, p / 100 });
+        } else if (item.compare(0, TIMEOUT.size(), TIMEOUT) == 0) {
+            double n = fromString<double>(item.substr(TIMEOUT.size()));
+            if (n < 1)
+                throw std::runtime_error("bad hedge schedule step `" + item + "': timeout divisor should be at least 1");
+            steps_.push_back(Step { Step::TIMEOUT_FRACTION, 1 / n });
+        } else if ((digits = std::find_if(item.begin(), item.end(), [](char c) { return !isdigit(c); }) - item.begin()) != 0) {
+            double val = fromString<double>(item.substr(0, digits));
+            std::string dim = item.substr(digits);
+            if (dim == "s")
+                val *= 1000000;
+            else if (dim == "ms")
+                val *= 1000;
+            else if (dim != "us")
+                throw std::runtime_error("bad hedge schedule step `" + item + "': use `<num>(s|ms|us)' format for durations");
+            steps_.push_back(Step { Step::FIXED, val });
+        } else {
+            throw std::runtime_error("bad hedge schedule step `" + item + "': use `pN', `timeout/N' or `<num>(s|ms|us)'");
+        }
+    }
+}
+
+const HedgeSchedule& HedgeSchedule::configured()
+{
+    static const HedgeSchedule s(options().readHedgeSchedule);
+    return s;
+}
+
+std::vector<std::chrono::microseconds> HedgeSchedule::delays(const Endpoint& endpt, std::chrono::milliseconds timeout) const
+{
+    std::vector<std::chrono::microseconds> ret;
+    for (const Step& step: steps_) {
+        std::chrono::microseconds d = std::chrono::microseconds::max();
+        if (step.kind == Step::PERCENTILE)
+            d = latencyPercentile(endpt, step.value);
+        else if (step.kind == Step::TIMEOUT_FRACTION && timeout != std::chrono::milliseconds::max())
+            d = std::chrono::microseconds(static_cast<std::chrono::microseconds::rep>(
+                std::chrono::duration_cast<std::chrono::microseconds>(timeout).count() * step.value));
+        else
+            d = std::chrono::microseconds(static_cast<std::chrono::microseconds::rep>(step.value));
+        
+        if (d != std::chrono::microseconds::max())
+            ret.push_back(d);
+    }
+    std::sort(ret.begin(), ret.end());
+    return ret;
+}
+
+
+void BackendDatasource::talk(std::function<std::vector<char>(uint32_t)> msgMaker)
+{
+    auto readReply = [](io::stream& s, uint32_t reqID) {
         Reply r;
-        r.cursorID = ::readReply(s, reqID, [this, &r](bson::Object obj) { r.objects.push_back(std::move(obj)); });
+        r.cursorID = ::readReply(s, reqID, [&r](bson::Object obj) { r.objects.push_back(std::move(obj)); });
         DEBUG(1) << "Returned " << r.objects.size() << " objects and cursor " << r.cursorID;
         return r;
     };
-
-    io::task<Reply> t1, t2;
-    Backend *b1 = 0, *b2 = 0;
     
-    auto handleErrors = [this, &t1, &t2, &b1, &b2](io::task<Reply>& t) -> Reply {
-        Backend* b = &t == &t1 ? b1 : b2;
+    // The request sent to a backend: either the original one,
+    // or its retransmit to another backend.
+    struct Attempt {
+        io::task<Reply> task;
+        Backend* backend;
+        bool hedge; // as opposed to retrying a failed request
+    };
+    
+    auto handleErrors = [this](Attempt& a) -> Reply {
         try {
-            return t.get();
+            return a.task.get();
         }
         catch (errors::NotMaster&) {
             shard_->lostMaster();
@@ -153,88 +314,121 @@ void BackendDatasource::talk(std::function<std::vector<char>(uint32_t)> msgMaker
             throw;
         }
         catch (std::exception&) {
-            shard_->failed(b);
+            shard_->failed(a.backend);
             throw;
         }
         
     };
 
-    auto useReply = [this, handleErrors](io::task<Reply>& t) {
-        Reply r = handleErrors(t);
-        objects_ = std::move(r.objects);
-        current_ = objects_.begin();
-        cursorID_ = r.cursorID;
-    };
-
     SteadyClock::time_point startedAt = SteadyClock::now();
     
-    io::timeout retransmit(std::chrono::milliseconds(readPref["retransmitMs"].as<unsigned>(options().readRetransmit.count())));
-    io::timeout timeout(std::chrono::milliseconds(readPref["timeoutMs"].as<unsigned>(options().readTimeout.count())));
+    std::chrono::milliseconds timeoutMs = policy_->timeout() != std::chrono::milliseconds::max()
+        ? policy_->timeout() : options().readTimeout;
+    io::timeout timeout(timeoutMs);
+    std::vector<std::chrono::microseconds> delays = hedgeDelays(*policy_, conn_.endpoint(), timeoutMs);
+    RetransmitBudget& budget = shard_->retransmitBudget();
+    if (!delays.empty())
+        budget.requested();
     
     uint32_t reqID = makeReqID();
     
-    TaskPool<Reply> pool;
-    Backend* b = b1 = &conn_.backend();
-    t1 = io::spawn([this, reqID, msgMaker, readReply]{
-        
-        Connection c = std::move(conn_);
-        std::vector<char> msg = msgMaker(reqID);
-
-        DEBUG(1) << "Starting communicating with endpoint " << c.endpoint();
-        c.establish(ns(), version_, msg.data(), msg.size());
-        DEBUG(1) << "Sent query to " << c.endpoint();
-
-        Reply reply = readReply(c.stream(), reqID);
-        conn_ = std::move(c);
-        return reply;
-        
-    });
-    pool.add(t1);
+    // Tasks do not refer to `this', since the ones losing the race
+    // are left to complete in background and may outlive us.
+    Namespace ns = this->ns();
+    ChunkVersion version = version_;
     
-    io::task<Reply>* t = pool.wait(std::min(retransmit, timeout));
+    auto send = [ns, version, reqID, readReply](Connection c, std::vector<char> msg) {
+        return io::spawn([ns, version, reqID, readReply, msg](Connection c) {
+            DEBUG(1) << "Starting communicating with endpoint " << c.endpoint();
+            c.establish(ns, version, msg.data(), msg.size());
+            DEBUG(1) << "Sent query to " << c.endpoint();
+            SteadyClock::time_point sent = SteadyClock::now();
+
+            Reply reply = readReply(c.stream(), reqID);
+            c.endpoint().requestCompleted(std::chrono::duration_cast<std::chrono::microseconds>(SteadyClock::now() - sent));
+            reply.conn = std::move(c);
+            return reply;
+        }, std::move(c));
+    };
     
-    if (t) {
-        try {
-            useReply(*t);
-            DEBUG(1) << "Query took " << std::chrono::duration_cast<std::chrono::milliseconds>(SteadyClock::now() - startedAt).count() << " ms";
-            return;
-        }
-        catch (errors::NotMaster&) {}
-        catch (errors::BackendClientError&) { throw; }
-        catch (std::exception&) {}
-        *t = io::task<Reply>();
-    }
+    std::vector<Attempt> attempts;
+    attempts.reserve(delays.size() + 1); // `pool' refers to the tasks
+    Shard::Backends used;
     
-    Connection c2;
-    if (retransmit.finite() && (c2 = shard_->readOp(msg_.flags, msg_.readPreference(), b)).exists()) {
-        b2 = &c2.backend();
-        DEBUG(1) << "Retransmitting query to " << c2.endpoint();
-        t2 = io::spawn([this, reqID, readReply](Connection c2){
-            std::vector<char> q = makeQuery(reqID);
-
-            DEBUG(1) << "(retransmit) Starting communicating with endpoint " << c2.endpoint();
-            c2.establish(ns(), version_, q.data(), q.size());
-            DEBUG(1) << "(retransmit) Sent query to " << c2.endpoint();
-
-            Reply reply = readReply(c2.stream(), reqID);
-            conn_ = std::move(c2);
-            return reply;
-        }, std::move(c2));
-        pool.add(t2);
-    }
+    TaskPool<Reply> pool;
+    pool.drainLosers(options().retransmitGrace, &recoverConnection);
     
-    t = pool.wait(timeout);
+    auto launch = [&attempts, &used, &pool, &send](Connection c, std::vector<char> msg, bool hedge) {
+        Backend* b = &c.backend();
+        used.push_back(b);
+        attempts.push_back(Attempt { send(std::move(c), std::move(msg)), b, hedge });
+        pool.add(attempts.back().task);
+    };
     
-    if (t) {
-        useReply(*t);
-        DEBUG(1) << "Query took " << std::chrono::duration_cast<std::chrono::milliseconds>(SteadyClock::now() - startedAt).count() << " ms";
-        return;
-    }
+    launch(std::move(conn_), msgMaker(reqID), false);
+    
+    size_t next = 0; // next step of the hedge schedule
+    std::exception_ptr error;
+    
+    for (;;) {
+        io::timeout wait = timeout;
+        if (next < delays.size())
+            wait = std::min(wait, io::timeout(startedAt + delays[next]));
         
-    if (t1.failed())
-        handleErrors(t1);
-    if (t2.failed())
-        handleErrors(t2);
+        io::task<Reply>* t = pool.wait(wait);
+        bool hedge = !t;
+        
+        if (t) {
+            Attempt& a = *std::find_if(attempts.begin(), attempts.end(), [t](const Attempt& a) { return &a.task == t; });
+            try {
+                Reply r = handleErrors(a);
+                objects_ = std::move(r.objects);
+                current_ = objects_.begin();
+                cursorID_ = r.cursorID;
+                conn_ = std::move(r.conn);
+                if (a.hedge)
+                    budget.won();
+                DEBUG(1) << "Query took " << std::chrono::duration_cast<std::chrono::milliseconds>(SteadyClock::now() - startedAt).count() << " ms";
+                return;
+            }
+            catch (errors::NotMaster&) { error = std::current_exception(); }
+            catch (errors::BackendClientError&) { throw; }
+            catch (std::exception&) { error = std::current_exception(); }
+            
+            if (!pool.empty())
+                continue; // someone else may still succeed
+        } else if (wait == timeout) {
+            break;
+        }
+        
+        if (next == delays.size())
+            break; // failed, and retransmits are not configured
+        ++next;
+        
+        // While other attempts are in flight, an exhausted connection pool
+        // means skipping this step rather than blocking until they are done.
+        Connection c = shard_->readOp(*policy_, used, pool.empty());
+        if (c.exists() && hedge && std::find(used.begin(), used.end(), &c.backend()) != used.end()) {
+            DEBUG(1) << "Not retransmitting query to shard " << shard_->id() << ": no other backend suitable";
+            c.release();
+            next = delays.size();
+        }
+        if (c.exists() && hedge && !budget.tryRetransmit()) {
+            DEBUG(1) << "Not retransmitting query to shard " << shard_->id() << ": retransmit budget exhausted";
+            c.release();
+            next = delays.size();
+        }
+        
+        if (c.exists()) {
+            DEBUG(1) << "Retransmitting query to " << c.endpoint();
+            launch(std::move(c), makeQuery(reqID), hedge);
+        } else if (pool.empty()) {
+            break;
+        }
+    }
+    
+    if (error)
+        std::rethrow_exception(error);
     throw io::error("timeout while talking to shard " + shard_->connectionString(), ETIMEDOUT);
 }
 
@@ -32,6 +32,7 @@
 #include "config.h"
 #include "log.h"
 #include "error.h"
+#include "readpref.h"
 #include <syncio/error.h>
 
 class Backend;
@@ -46,6 +47,36 @@ public:
     void doAdvance() override { ASSERT(!"NullDatasource::doAdvance(): should never reach here"); }
 };
 
+/// Delays after which a query is additionally sent to one more replica
+/// (see `--read-hedge-schedule'). Each step is either a percentile of recent
+/// roundtrips to the endpoint the query has initially been sent to ("p90"),
+/// a fraction of the query timeout ("timeout/2") or a fixed duration ("20ms").
+class HedgeSchedule {
+public:
+    HedgeSchedule() {}
+    
+    /// Parses a comma-separated list of steps; throws std::runtime_error if malformed.
+    explicit HedgeSchedule(const std::string& spec);
+    
+    /// The schedule specified on command line.
+    static const HedgeSchedule& configured();
+    
+    bool empty() const { return steps_.empty(); }
+    
+    /// Returns delays (since the query was sent) in ascending order,
+    /// omitting steps which cannot be evaluated yet (a percentile
+    /// of an endpoint which has not served enough requests).
+    std::vector<std::chrono::microseconds> delays(const Endpoint& endpt, std::chrono::milliseconds timeout) const;
+    
+private:
+    struct Step {
+        enum Kind { PERCENTILE, TIMEOUT_FRACTION, FIXED } kind;
+        double value; // fraction for the former two, microseconds for FIXED
+    };
+    std::vector<Step> steps_;
+};
+
+
 class BackendDatasource: public DataSource {
 public:
     BackendDatasource(std::shared_ptr<Shard> shard, ChunkVersion version, messages::Query query);
@@ -69,7 +100,7 @@ public:
     
     void doClose() override;
     
-    void reportConnections(std::vector<const Connection*>& dest) const override { dest.push_back(&conn_); }
+    void reportEndpoints(std::vector<const Endpoint*>& dest) const override { if (endpt_) dest.push_back(endpt_); }
     
 private /*methods*/:
     std::shared_ptr<Config> config_;
@@ -81,11 +112,18 @@ private /*methods*/:
     uint32_t makeReqID() { return reqID_++; }
     Namespace ns() const;
     
+    /// Returns the connection to the pool between batches, remembering
+    /// the endpoint holding the cursor.
+    void detach();
+    
 private /*fields*/:
     std::shared_ptr<Shard> shard_;
     ChunkVersion version_;
-    Connection conn_;
+    Connection conn_;         // only held while talking to the backend
+    Endpoint* endpt_ = 0;     // where the cursor lives
+    bool primary_ = false;    // whether `conn_' was a primary one
     messages::Query msg_;
+    std::shared_ptr<const ReadPolicy> policy_;
     uint64_t cursorID_;
     uint32_t reqID_;
     std::vector<bson::Object> objects_;
@@ -104,10 +142,10 @@ public:
     void doAdvance() override;
     void doClose() override;
 
-    void reportConnections(std::vector<const Connection*>& dest) const override
+    void reportEndpoints(std::vector<const Endpoint*>& dest) const override
     {
         for (const auto& ds: datasources_)
-            ds->reportConnections(dest);
+            ds->reportEndpoints(dest);
     }
 
 private:
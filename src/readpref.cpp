@@ -0,0 +1,118 @@
+/**
+ * readpref.cpp -- compiled read preferences
+ *
+ * This file is part of mongoz, a more sound implementation
+ * of mongodb sharding server.
+ *
+ * Copyright (c) 2016 YANDEX LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "readpref.h"
+#include "proto.h"
+#include "options.h"
+#include "error.h"
+#include <syncio/syncio.h>
+#include <atomic>
+#include <mutex>
+
+namespace {
+
+/// Bounds the number of interned policies, so a client generating
+/// distinct read preferences cannot make us grow without limit.
+const size_t MAX_INTERNED = 1024;
+
+ReadPolicy::Mode parseMode(const std::string& mode)
+{
+    if (mode == "primary")
+        return ReadPolicy::Mode::PRIMARY;
+    else if (mode == "primaryPreferred")
+        return ReadPolicy::Mode::PRIMARY_PREFERRED;
+    else if (mode == "secondary")
+        return ReadPolicy::Mode::SECONDARY;
+    else if (mode == "secondaryPreferred")
+        return ReadPolicy::Mode::SECONDARY_PREFERRED;
+    else if (mode == "nearest")
+        return ReadPolicy::Mode::NEAREST;
+    else
+        throw errors::BadRequest("unknown read preference mode `" + mode + "'");
+}
+
+} // namespace
+
+ReadPolicy::ReadPolicy(uint32_t queryFlags, const bson::Object& readPref):
+    maxLag_(options().maxReplLag)
+{
+    if (readPref.empty()) {
+        if (queryFlags & messages::Query::SLAVE_OK)
+            mode_ = Mode::NEAREST;
+        return;
+    }
+    
+    mode_ = parseMode(readPref["mode"].as<std::string>("primary"));
+    
+    for (const bson::Element& set: readPref["tags"].as<bson::Array>(bson::Array())) {
+        TagSet tags;
+        for (const bson::Element& tag: set.as<bson::Object>()) {
+            if (!tag.is<std::string>())
+                throw errors::BadRequest(std::string("read preference tag `") + tag.name() + "' is not a string");
+            tags[tag.name()] = tag.as<std::string>();
+        }
+        tags_.push_back(std::move(tags));
+    }
+    
+    if (readPref["maxStalenessSeconds"].exists())
+        maxLag_ = std::chrono::seconds(readPref["maxStalenessSeconds"].as<unsigned>());
+    if (readPref["timeoutMs"].exists())
+        timeout_ = std::chrono::milliseconds(readPref["timeoutMs"].as<unsigned>());
+    if (readPref["retransmitMs"].exists())
+        retransmit_ = std::chrono::milliseconds(readPref["retransmitMs"].as<unsigned>());
+}
+
+std::shared_ptr<const ReadPolicy> ReadPolicy::get(uint32_t queryFlags, const bson::Object& readPref)
+{
+    typedef std::map<std::string, std::shared_ptr<const ReadPolicy> > Policies;
+    static Policies g_policies;
+    static io::sys::shared_mutex g_mutex;
+    static std::atomic<size_t> g_lastID(0);
+    
+    // The slaveOK flag only matters if no read preference is specified.
+    std::string key(1, (readPref.empty() && (queryFlags & messages::Query::SLAVE_OK)) ? 's' : '-');
+    key.append(static_cast<const char*>(readPref.rawData()), readPref.rawSize());
+    
+    {
+        io::shared_lock<io::sys::shared_mutex> lock(g_mutex);
+        auto i = g_policies.find(key);
+        if (i != g_policies.end())
+            return i->second;
+    }
+    
+    std::shared_ptr<ReadPolicy> policy(new ReadPolicy(queryFlags, readPref));
+    
+    std::unique_lock<io::sys::shared_mutex> lock(g_mutex);
+    auto i = g_policies.find(key);
+    if (i != g_policies.end())
+        return i->second;
+    if (g_policies.size() >= MAX_INTERNED)
+        return policy; // not cached anywhere
+    
+    policy->id_ = ++g_lastID;
+    return g_policies.insert(std::make_pair(key, std::move(policy))).first->second;
+}
@@ -0,0 +1,77 @@
+/**
+ * readpref.h -- compiled read preferences
+ *
+ * This file is part of mongoz, a more sound implementation
+ * of mongodb sharding server.
+ *
+ * Copyright (c) 2016 YANDEX LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <bson/bson.h>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <map>
+
+/// A read preference (`$readPreference' and the slaveOK flag of a query)
+/// parsed once and shared by all queries specifying the same one.
+class ReadPolicy {
+public:
+    enum class Mode { PRIMARY, PRIMARY_PREFERRED, SECONDARY, SECONDARY_PREFERRED, NEAREST };
+    typedef std::map<std::string, std::string> TagSet;
+    
+    /// Returns the policy corresponding to given query flags and read preference.
+    /// Policies are interned, so this is cheap for read preferences seen before.
+    static std::shared_ptr<const ReadPolicy> get(uint32_t queryFlags, const bson::Object& readPref);
+    
+    /// A unique number of an interned policy, suitable as a cache key
+    /// (zero if too many distinct policies have been seen to intern this one).
+    size_t id() const { return id_; }
+    
+    Mode mode() const { return mode_; }
+    
+    /// Whether the query may be served by a secondary.
+    bool slaveOK() const { return mode_ != Mode::PRIMARY; }
+    
+    /// Tag sets a backend should match (any of them); empty if any backend will do.
+    const std::vector<TagSet>& tags() const { return tags_; }
+    
+    /// Maximal replication lag of a backend (`maxStalenessSeconds'
+    /// or `--max-repl-lag'), or max() if not limited.
+    std::chrono::milliseconds maxLag() const { return maxLag_; }
+    
+    /// `timeoutMs' and `retransmitMs' of the read preference, or max() if not specified.
+    std::chrono::milliseconds timeout() const { return timeout_; }
+    std::chrono::milliseconds retransmit() const { return retransmit_; }
+    
+private:
+    size_t id_ = 0;
+    Mode mode_ = Mode::PRIMARY;
+    std::vector<TagSet> tags_;
+    std::chrono::milliseconds maxLag_;
+    std::chrono::milliseconds timeout_ = std::chrono::milliseconds::max();
+    std::chrono::milliseconds retransmit_ = std::chrono::milliseconds::max();
+    
+    ReadPolicy(uint32_t queryFlags, const bson::Object& readPref);
+};
@@ -494,11 +494,11 @@ bson::Object Session::command(const messages::Query& q)
             return failure(20, "cursor not found");
         
         bson::ArrayBuilder b;
-        for (const Connection* c: ds->usedConnections())
+        for (const Endpoint* e: ds->usedEndpoints())
             b << bson::object(
-                "shard", c->backend().shard()->id(),
-                "backend", c->backend().addr(),
-                "endpoint", toString(c->endpoint().addr())
+                "shard", e->backend().shard()->id(),
+                "backend", e->backend().addr(),
+                "endpoint", toString(e->addr())
             );
         return success("backends", b.array());
         
@@ -32,10 +32,139 @@
 #include "write.h"
 #include "clock.h"
 #include "log.h"
+#include "utility.h"
 #include <bson/bson11.h>
 #include <cstdlib>
 #include <map>
 
+void RetransmitBudget::requested()
+{
+    std::unique_lock<io::sys::mutex> lock(mutex_);
+    SteadyClock::time_point now = SteadyClock::now();
+    tokens_ += options().retransmitBudget / 100.0
+        + std::chrono::duration_cast<std::chrono::duration<double>>(now - refilledAt_).count();
+    if (tokens_ > BURST)
+        tokens_ = BURST;
+    refilledAt_ = now;
+}
+
+bool RetransmitBudget::tryRetransmit()
+{
+    std::unique_lock<io::sys::mutex> lock(mutex_);
+    if (tokens_ < 1) {
+        ++suppressed_;
+        return false;
+    }
+    tokens_ -= 1;
+    ++sent_;
+    return true;
+}
+
+
+void Shard::failed(Backend* b)
+{
+    OutlierDetector& outlier = b->outlier();
+    bool recovering = (outlier.state() == OutlierDetector::State::RECOVERING);
+    unsigned errors = outlier.failed();
+    if (recovering)
+        eject(b, "failed while recovering from previous ejection");
+    else if (options().outlierErrors && errors >= options().outlierErrors)
+        eject(b, std::to_string(errors) + " consecutive failures");
+    
+    onFailure(b);
+    b->failed();
+}
+
+void Shard::succeeded(Backend* b)
+{
+    OutlierDetector& outlier = b->outlier();
+    outlier.succeeded();
+    if (!options().outlierLatencyFactor || outlier.state() == OutlierDetector::State::EJECTED || !outlier.latencyCheckDue())
+        return;
+    
+    // Network roundtrip is subtracted, so that replicas in remote datacenters
+    // are not considered outliers just because they are far away.
+    SteadyClock::time_point since = SteadyClock::now() - options().pingInterval;
+    auto serviceTime = [since](const Backend* b) {
+        const Endpoint* endpt = b->endpoint();
+        if (!endpt->alive() || !endpt->latency().hasSamplesSince(since))
+            return std::chrono::microseconds::max();
+        return std::max(endpt->latency().average() - endpt->roundtrip(), std::chrono::microseconds::zero());
+    };
+    
+    std::chrono::microseconds mine = serviceTime(b);
+    if (mine == std::chrono::microseconds::max())
+        return;
+    
+    std::vector<std::chrono::microseconds> peers;
+    for (const std::unique_ptr<Backend>& peer: backends_) {
+        if (peer.get() == b || peer->outlier().state() != OutlierDetector::State::ACTIVE)
+            continue;
+        std::chrono::microseconds t = serviceTime(peer.get());
+        if (t != std::chrono::microseconds::max())
+            peers.push_back(t);
+    }
+    
+    static const size_t MIN_PEERS = 2;
+    if (peers.size() < MIN_PEERS)
+        return;
+    
+    std::nth_element(peers.begin(), peers.begin() + peers.size() / 2, peers.end());
+    std::chrono::microseconds median = peers[peers.size() / 2];
+    if (mine > median * options().outlierLatencyFactor && mine - median > options().localThreshold) {
+        eject(b, "serves requests in " + std::to_string(mine.count() / 1000) + " ms"
+            + " while the median is " + std::to_string(median.count() / 1000) + " ms");
+    }
+}
+
+Connection Shard::primary(io::timeout timeout)
+{
+    for (;;) {
+        uint64_t seen = primaryEpoch();
+        Connection c = primary();
+        if (c.exists() || timeout.expired())
+            return c;
+        
+        // Replica sets announce new primaries as soon as they see them;
+        // an occasional recheck covers everything else.
+        DEBUG(2) << "Shard " << id() << " has no primary; waiting for one";
+        waitForPrimary(seen, std::min(timeout, io::timeout(options().pingInterval)));
+    }
+}
+
+bool Shard::waitForPrimary(uint64_t seen, io::timeout timeout)
+{
+    std::unique_lock<io::mutex> lock(primaryMutex_);
+    return primaryCond_.wait_until(lock, timeout, [this, seen]{ return primaryEpoch_ != seen; });
+}
+
+void Shard::primaryChanged()
+{
+    std::unique_lock<io::mutex> lock(primaryMutex_);
+    ++primaryEpoch_;
+    primaryCond_.notify_all();
+}
+
+void Shard::eject(Backend* b, const std::string& reason)
+{
+    if (options().outlierEjectTime == std::chrono::milliseconds::zero())
+        return;
+    
+    std::unique_lock<io::sys::mutex> lock(ejectMutex_);
+    size_t ejected = std::count_if(backends_.begin(), backends_.end(), [](const std::unique_ptr<Backend>& b) {
+        return b->outlier().state() == OutlierDetector::State::EJECTED;
+    });
+    if ((ejected + 1) * 100 > backends_.size() * options().outlierMaxEjected) {
+        DEBUG(1) << "Not ejecting " << b->addr() << " from shard " << id() << " (" << reason << "): "
+                 << ejected << " of " << backends_.size() << " backends already ejected";
+        return;
+    }
+    
+    b->outlier().eject();
+    NOTICE() << "Ejecting " << b->addr() << " from shard " << id() << " for "
+             << std::chrono::duration_cast<std::chrono::seconds>(b->outlier().ejectedFor()).count() << " s: " << reason;
+}
+
 std::unique_ptr<WriteOperation> Shard::write(Namespace ns, ChunkVersion v, std::vector<char> msg)
 {
     return std::unique_ptr<WriteOperation>(new WriteToBackend24(
@@ -48,6 +177,12 @@ std::unique_ptr<WriteOperation> Shard::write(Namespace ns, ChunkVersion v, bson:
         Config::VersionedShard { shared_from_this(), std::move(v) }, std::move(ns), std::move(cmd)));
 }
 
+std::unique_ptr<WriteOperation> Shard::writeLegacy(Namespace ns, ChunkVersion v, bson::Object cmd)
+{
+    return std::unique_ptr<WriteOperation>(new WriteLegacyAsCommand(
+        Config::VersionedShard { shared_from_this(), std::move(v) }, std::move(ns), std::move(cmd)));
+}
+
 Backend::SoftwareVersion Shard::softwareVersion() const
 {
     typedef Backend::SoftwareVersion Version;
@@ -82,20 +217,25 @@ bson::Object Shard::debugInspect() const
 
 namespace shard_types {
 
+static bool excluded(const Backend* b, const Shard::Backends& exclude)
+{
+    return std::find(exclude.begin(), exclude.end(), b) != exclude.end();
+}
+
 class Null: public Shard {
 public:
     Null(): Shard({}, {}) {}
-    Connection readOp(uint32_t, const bson::Object&, Backend*) override { return {}; }
+    Connection readOp(const ReadPolicy&, const Backends&, bool) override { return {}; }
 };
 
 class Single: public Shard {
 public:
     explicit Single(const std::string& addr): Shard({}, { addr }) {}
     
-    Connection readOp(uint32_t, const bson::Object&, Backend* exclude) override
+    Connection readOp(const ReadPolicy&, const Backends& exclude, bool wait) override
     {
-        if (backend()->alive() && backend() != exclude)
-            return backend()->endpoint()->getPrimary();
+        if (backend()->alive() && !excluded(backend(), exclude))
+            return backend()->endpoint()->getPrimary(wait);
         else
             return {};
     }
@@ -108,6 +248,16 @@ public:
             return {};
     }
     
+    void backendUpdated(Backend*) override
+    {
+        // Only a backend coming back is news to writers waiting for a primary
+        bool alive = backend()->alive();
+        if (alive && !wasAlive_.exchange(alive))
+            primaryChanged();
+        else if (!alive)
+            wasAlive_ = false;
+    }
+    
     monitoring::Status status() const override
     {
         if (backend()->alive())
@@ -118,6 +268,8 @@ public:
     
 private:
     Backend* backend() const { return begin()->get(); }
+    
+    std::atomic<bool> wasAlive_ { false };
 };
 
 
@@ -133,31 +285,75 @@ protected:
     void backendUpdated(Backend*) override { byRoundtrip_.clear(); }
     void onFailure(Backend*) override { byRoundtrip_.clear(); }
     
+    typedef std::pair<Backend*, std::chrono::microseconds> Candidate; // backend and its expected roundtrip
+    
     template<class Pred>
     Backend* selectLocal(Pred pred)
     {
-        std::vector<Backend*> candidates;
         auto byrt = byRoundtrip();
-        for (Backend* b: byrt.value()) {
+        return selectLocal(byrt.value(), pred);
+    }
+    
+    /// Selects one of `backends' satisfying `pred'.
+    template<class Pred>
+    Backend* selectLocal(const std::vector<Backend*>& backends, Pred pred)
+    {
+        // Expected roundtrips reflect actual requests and can change between pings,
+        // so they are taken afresh rather than relying on byRoundtrip() order.
+        // Ejected outliers (and recovering ones, for a part of requests)
+        // are only used if there is nothing else left.
+        std::vector<Candidate> candidates, outliers;
+        for (Backend* b: backends) {
             if (pred(b))
-                candidates.push_back(b);
+                (b->outlier().admits() ? candidates : outliers).push_back(std::make_pair(b, expectedLatency(b)));
         }
 
+        if (candidates.empty())
+            std::swap(candidates, outliers);
         if (candidates.empty())
             return 0;
 
-        auto threshold = candidates.front()->roundtrip() + options().localThreshold;
-        auto it = candidates.begin();
-        for (; it != candidates.end() && (*it)->roundtrip() < threshold; ++it) {}
-        if (it == candidates.begin())
-            it = candidates.end();
+        auto fastest = std::min_element(candidates.begin(), candidates.end(),
+            [](const Candidate& a, const Candidate& b) { return a.second < b.second; });
+        if (fastest->second != std::chrono::microseconds::max()) {
+            auto threshold = fastest->second + options().localThreshold;
+            candidates.erase(std::remove_if(candidates.begin(), candidates.end(),
+                [threshold](const Candidate& c) { return c.second > threshold; }
+            ), candidates.end());
+        }
+        
+        // Power of two choices: of two random candidates take the one with less
+        // requests in flight (weighted by its roundtrip time), so a replica
+        // slowed down by load stops receiving its full share of traffic.
+        size_t n = candidates.size();
+        if (n == 1)
+            return candidates.front().first;
         
-        unsigned i = rand() * std::distance(candidates.begin(), it) / ((unsigned long long) RAND_MAX + 1);
-        return candidates[i];
+        size_t i = randomIndex(n);
+        size_t j = randomIndex(n - 1);
+        if (j >= i)
+            ++j;
+        return load(candidates[j]) < load(candidates[i]) ? candidates[j].first : candidates[i].first;
     }
 
 private:
     Lazy< std::vector<Backend*> > byRoundtrip_;
+    
+    /// Returns the roundtrip to expect from `b', plus the time a request
+    /// is likely to wait in its queue (scaled by `--server-load-weight'),
+    /// so that reads move away from replicas busy with heavy jobs.
+    static std::chrono::microseconds expectedLatency(const Backend* b)
+    {
+        std::chrono::microseconds rt = b->expectedRoundtrip();
+        if (rt == std::chrono::microseconds::max() || !options().serverLoadWeight)
+            return rt;
+        return rt + b->queueDelay() * static_cast<int64_t>(options().serverLoadWeight) / 100;
+    }
+    
+    static double load(const Candidate& c)
+    {
+        return (c.first->inFlight() + 1) * static_cast<double>(c.second.count());
+    }
 
     std::vector<Backend*> calcByRoundtrip()
     {
@@ -187,45 +383,67 @@ static const std::vector<Shard::PingQuery> RS_PING_QUERIES = {
 class ReplicaSet: public Multiple {
 private:
     typedef decltype(Options::maxReplLag) Optime;
-    struct BackendInfo {
-        bson::Object tags;
+    typedef std::map<std::string, std::string> Tags;
+    
+    /// Member status as of its last ping, parsed once.
+    struct MemberHealth {
+        bool alive = false;
+        int state = 0;           // replica set member state (`myState'), e.g. 1 for primary
+        std::string stateStr;
         Optime optime = Optime::max();
+        Tags tags;
+        
+        bool isPrimary() const { return alive && state == 1; }
+        bool isHealthy() const { return alive && (state == 1 || state == 2); }
+    };
+    
+    /// Backends eligible for a read policy, ordered by roundtrip, keyed by policy id.
+    typedef std::map<size_t, std::shared_ptr<const std::vector<Backend*> > > CandidateCache;
+    
+    /// An immutable snapshot of the replica set status, replaced as a whole
+    /// whenever any member changes, so that readers need no locks.
+    struct Health {
+        std::map<const Backend*, MemberHealth> members;
+        Backend* primary = 0;
+        Optime maxOptime = Optime::max();
+        
+        /// Filled in on demand by readers (and accessed atomically);
+        /// starts empty in each new snapshot.
+        mutable std::shared_ptr<const CandidateCache> candidates;
+        
+        const MemberHealth& member(const Backend* b) const
+        {
+            static const MemberHealth NONE;
+            auto i = members.find(b);
+            return i != members.end() ? i->second : NONE;
+        }
     };
-    typedef std::map<const Backend*, BackendInfo> BackendInfoMap;
 
 public:
     ReplicaSet(std::string name, const std::vector<std::string>& addrs):
         Multiple(RS_PING_QUERIES, addrs), name_(std::move(name)),
-        primary_([this]{ return calcPrimary(); }),
+        health_(std::make_shared<Health>()),
         lostPrimarySince_(SteadyClock::now())
     {
         pingNow();
     }
     
-    Connection readOp(uint32_t queryFlags, const bson::Object& readPref, Backend* exclude) override
+    Connection readOp(const ReadPolicy& policy, const Backends& exclude, bool wait) override
     {
         waitForPings();
+        std::shared_ptr<const Health> health = this->health();
         
-        std::string mode = "primary";
-        bson::Array tags;
-        
-        if (!readPref.empty()) {
-            mode = readPref["mode"].as<std::string>();
-            tags = readPref["tags"].as<bson::Array>(bson::Array());
-        } else if (queryFlags & messages::Query::SLAVE_OK) {
-            mode = "nearest";
-        }
-        
-        if (mode == "primary" || mode == "primaryPreferred") {
-            Backend* p = primary_.get().value();
+        if (policy.mode() == ReadPolicy::Mode::PRIMARY || policy.mode() == ReadPolicy::Mode::PRIMARY_PREFERRED) {
+            Backend* p = health->primary;
             if (p) {
                 DEBUG(2) << "current primary for shard " << id() << ": " << p->addr();
             } else {
                 DEBUG(2) << "shard " << id() << " has no primary";
             }
             
-            if (mode == "primary" || (p != exclude && p && tagsMatch(p, tags))) {
-                
+            if (policy.mode() == ReadPolicy::Mode::PRIMARY
+                || (p && !excluded(p, exclude) && tagsMatch(health->member(p).tags, policy.tags())))
+            {
                 // On `primary' read preference previous primary node might have been
                 // re-elected as primary node again. Since after primary failure
                 // we've issued an emergency ping and now we are sure that `p' is
@@ -233,7 +451,7 @@ public:
                 
                 if (p) {
                     DEBUG(2) << "Selecting " << p->addr() << " for operation";
-                    return p->endpoint()->getPrimary();
+                    return p->endpoint()->getPrimary(wait);
                 } else {
                     DEBUG(2) << "No backend suitable for operation";
                     return Connection();
@@ -242,24 +460,30 @@ public:
         }
         
         // We are not distinguishing `secondary', `secondaryPreferred' and `nearest'.
-        std::map<const Backend*, BackendInfo> info;
-        if (options().maxReplLag != decltype(options().maxReplLag)::max() || !tags.empty())
-            info = backendInfo();
+        std::shared_ptr<const std::vector<Backend*> > eligible = this->eligible(*health, policy);
         
-        Optime optimeThreshold = options().maxReplLag != decltype(options().maxReplLag)::max()
-            ? this->maxOptime(info) - options().maxReplLag
-            : Optime(0);
-        
-        Backend* b = selectLocal([this, &tags, exclude, &info, optimeThreshold](Backend* b){
-            auto i = info.find(b);
-            return isHealthy(b) && b != exclude && (info.empty() || (i != info.end()
-                    && tagsMatch(i->second.tags, tags)
-                    && i->second.optime >= optimeThreshold
-                ));
-        });
+        Backend* b = 0;
+        if (!exclude.empty() && !options().hedgeSpreadTag.empty()) {
+            // Replicas in the same datacenter as the ones the request has already
+            // been sent to are likely to be just as slow, so try elsewhere first.
+            const std::string& key = options().hedgeSpreadTag;
+            b = selectLocal(*eligible, [&health, &key, &exclude](Backend* b) {
+                if (excluded(b, exclude))
+                    return false;
+                const Tags& tags = health->member(b).tags;
+                auto mine = tags.find(key);
+                return std::none_of(exclude.begin(), exclude.end(), [&health, &key, &tags, &mine](const Backend* e) {
+                    const Tags& used = health->member(e).tags;
+                    auto i = used.find(key);
+                    return i != used.end() && mine != tags.end() && i->second == mine->second;
+                });
+            });
+        }
+        if (!b)
+            b = selectLocal(*eligible, [&exclude](Backend* b) { return !excluded(b, exclude); });
         if (b) {
             DEBUG(2) << "Selecting " << b->addr() << " for operation";
-            return b->endpoint()->getAny();
+            return b->endpoint()->getAny(wait);
         } else {
             DEBUG(2) << "No backend suitable for operation";
             return Connection();
@@ -269,7 +493,7 @@ public:
     Connection primary() override
     {
         waitForPings();
-        Backend* p = primary_.get().value();
+        Backend* p = health()->primary;
         return p ? p->endpoint()->getPrimary() : Connection();
     }
     
@@ -277,37 +501,49 @@ public:
     {
         Multiple::backendUpdated(b);
         
-        bool isPrimary = this->isPrimary(b);
-        if (isPrimary) {
-            primary_.assign(b);
-            lostPrimarySince_ = decltype(lostPrimarySince_)::max();
-        } else if (b == primary_.get().value()) {
-            lostMaster();
-        }
-        
+        // All parsing of ping results happens here, once per ping.
+        MemberHealth m;
         if (b->alive()) {
             bson::Object status = b->status();
             bson::Object self = find(status["status"]["members"], "self", bson::Any());
             std::string id = self["name"].as<std::string>("");
             bson::Time optime = self["optimeDate"].as<bson::Time>(bson::Time(0));
             bson::Object tags = find(status["conf"]["members"], "host", id)["tags"].as<bson::Object>(bson::Object());
-        
-            auto lock = uniqueLock();
-            auto& info = backendInfo_[b];
-            info.tags = std::move(tags);
-            info.optime = std::chrono::duration_cast<Optime>(std::chrono::milliseconds(optime.milliseconds()));
+            
+            m.alive = true;
+            m.state = status["status"]["myState"].as<int>(0);
+            m.stateStr = self["stateStr"].as<std::string>("UNKNOWN");
+            m.optime = std::chrono::duration_cast<Optime>(std::chrono::milliseconds(optime.milliseconds()));
+            
+            // Full status is fetched less often than `isMaster', which
+            // (since 3.4) reports the time of the last write as well.
+            bson::Element lastWrite = status["is_master"]["lastWrite"]["lastWriteDate"];
+            if (lastWrite.exists() && lastWrite.is<bson::Time>()) {
+                Optime recent = std::chrono::duration_cast<Optime>(std::chrono::milliseconds(lastWrite.as<bson::Time>().milliseconds()));
+                if (recent > m.optime)
+                    m.optime = recent;
+            }
+            for (const bson::Element& tag: tags)
+                if (tag.is<std::string>())
+                    m.tags[tag.name()] = tag.as<std::string>();
         }
+        
+        bool lost = update(b, [&m](MemberHealth& dest) {
+            if (!m.alive) {
+                // Keep what is known about a dead member
+                dest.alive = false;
+            } else {
+                dest = std::move(m);
+            }
+        });
+        if (lost)
+            lostMaster();
     }
     
     void onFailure(Backend* b) override
     {
-        bool lostMaster = false;
-        {
-            auto primary = primary_.cached();
-            if (primary.exists() && b == primary.value())
-                lostMaster = true;
-        }
-        if (lostMaster)
+        bool lost = update(b, [](MemberHealth& dest) { dest.alive = false; });
+        if (lost)
             this->lostMaster();
         Multiple::onFailure(b);
     }
@@ -315,37 +551,38 @@ public:
     void lostMaster() override
     {
         DEBUG(2) << "Shard " << id() << " lost its primary node; will re-ping";
-        primary_.clear();
-        if (lostPrimarySince_ == decltype(lostPrimarySince_)::max())
-            lostPrimarySince_ = SteadyClock::now();
+        SteadyClock::time_point never = SteadyClock::time_point::max();
+        if (!health()->primary)
+            lostPrimarySince_.compare_exchange_strong(never, SteadyClock::now());
+        
+        // An election is likely under way; members not reporting changes
+        // by themselves (see Endpoint::keepWatching()) are polled closer.
+        for (const std::unique_ptr<Backend>& b: *this)
+            for (const std::unique_ptr<Endpoint>& endpt: b->endpoints())
+                endpt->unsettle();
         pingNow();
     }
     
     std::string status(const Backend* b) const override
     {
         waitForPings();
-        if (!isHealthy(b))
+        std::shared_ptr<const Health> health = this->health();
+        const MemberHealth& m = health->member(b);
+        if (!m.isHealthy())
             return "DEAD";
-        for (const bson::Element& elt: b->status()["status"]["members"].as<bson::Array>()) {
-            if (elt["self"].exists())
-                return elt["stateStr"].as<std::string>();
-        }
-        return "UNKNOWN";
+        return m.stateStr;
     }
     
     std::chrono::milliseconds replicationLag(const Backend* b) const override
     {
         waitForPings();
-        if (!isHealthy(b))
+        std::shared_ptr<const Health> health = this->health();
+        const MemberHealth& m = health->member(b);
+        if (!m.isHealthy())
             return Optime::max();
-        
-        auto info = backendInfo();
-        Optime maxOptime = this->maxOptime(info);
-        auto i = info.find(b);
-        if (i != info.end())
-            return std::chrono::duration_cast<std::chrono::milliseconds>(maxOptime - i->second.optime);
-        else
+        if (m.optime == Optime::max())
             return std::chrono::milliseconds::max();
+        return std::chrono::duration_cast<std::chrono::milliseconds>(health->maxOptime - m.optime);
     }
     
     monitoring::Status status() const override
@@ -357,35 +594,37 @@ public:
         
         monitoring::Status ret;
         
-        auto info = backendInfo();
+        std::shared_ptr<const Health> health = this->health();
         Optime optimeThreshold = options().maxReplLag != decltype(options().maxReplLag)::max()
-            ? this->maxOptime(info) - options().maxReplLag
+            ? health->maxOptime - options().maxReplLag
             : Optime(0);
 
         for (const std::unique_ptr<Backend>& backend: *this) {
-            auto i = info.find(backend.get());
-            if (!backend->alive() || !isHealthy(backend.get())) {
+            const MemberHealth& m = health->member(backend.get());
+            if (!m.isHealthy()) {
                 ret.merge(monitoring::Status::warning(backend->addr() + " is dead"));
             } else if (!backend->permanentErrmsg().empty()) {
                 ret.merge(monitoring::Status::critical(
                     backend->addr() + " is permanently half-alive: " + backend->permanentErrmsg()
                 ));
-            } else if (i == info.end() || i->second.optime < optimeThreshold) {
+            } else if (m.optime == Optime::max() || m.optime < optimeThreshold) {
                 ret.merge(monitoring::Status::warning(backend->addr() + "'s replication lag exceeds threshold"));
             } else {
                 hasAliveMember = true;
-                if (isPrimary(backend.get()))
+                if (m.isPrimary())
                     hasPrimary = true;
             }
         }
         
+        SteadyClock::time_point lostPrimarySince = lostPrimarySince_;
         if (!hasPrimary) {
             if (options().monitorNoPrimary != decltype(Options::monitorNoPrimary)::max()
-                && SteadyClock::now() >= lostPrimarySince_ + options().monitorNoPrimary)
+                && lostPrimarySince != SteadyClock::time_point::max()
+                && SteadyClock::now() >= lostPrimarySince + options().monitorNoPrimary)
             {
                 ret.merge(monitoring::Status::critical(
                     "replica set " + id() + " has no primary member for "
-                    + std::to_string( std::chrono::duration_cast<std::chrono::minutes>(SteadyClock::now() - lostPrimarySince_).count() )
+                    + std::to_string( std::chrono::duration_cast<std::chrono::minutes>(SteadyClock::now() - lostPrimarySince).count() )
                     + " min"
                 ));
             } else {
@@ -401,8 +640,42 @@ public:
     
 private /*methods*/:
     
-    std::unique_lock<io::sys::shared_mutex> uniqueLock() { return std::unique_lock<io::sys::shared_mutex>(mutex_); }
-    io::shared_lock<io::sys::shared_mutex> sharedLock() const { return io::shared_lock<io::sys::shared_mutex>(mutex_); }
+    std::shared_ptr<const Health> health() const { return std::atomic_load(&health_); }
+    
+    /// Publishes a new health snapshot with `b' modified by `f'.
+    /// Returns true if `b' was the primary and is no longer one.
+    template<class F>
+    bool update(Backend* b, F f)
+    {
+        std::unique_lock<io::sys::mutex> lock(updateMutex_);
+        
+        std::shared_ptr<const Health> prev = health();
+        std::shared_ptr<Health> next = std::make_shared<Health>(*prev);
+        next->candidates.reset();
+        f(next->members[b]);
+        
+        next->primary = 0;
+        next->maxOptime = Optime::max();
+        for (const auto& kv: next->members) {
+            if (kv.second.isPrimary())
+                next->primary = const_cast<Backend*>(kv.first);
+            if (kv.second.optime != Optime::max() && (next->maxOptime == Optime::max() || kv.second.optime > next->maxOptime))
+                next->maxOptime = kv.second.optime;
+        }
+        if (next->member(b).isPrimary())
+            next->primary = b; // the most recent claim wins
+        if (next->primary)
+            lostPrimarySince_ = SteadyClock::time_point::max();
+        
+        bool lost = (prev->primary == b && next->primary != b);
+        bool elected = (next->primary && next->primary != prev->primary);
+        std::atomic_store(&health_, std::shared_ptr<const Health>(std::move(next)));
+        lock.unlock();
+        
+        if (elected)
+            primaryChanged();
+        return lost;
+    }
     
     template<class T>
     bson::Object find(const bson::Element& objs, const char* key, const T& value)
@@ -419,68 +692,50 @@ private /*methods*/:
         return bson::Object();
     }
     
-    Backend* calcPrimary()
+    static bool tagsMatch(const Tags& tags, const std::vector<ReadPolicy::TagSet>& criteria)
     {
-        auto i = std::find_if(begin(), end(), [](const std::unique_ptr<Backend>& b) {
-            return isPrimary(b.get());
+        return criteria.empty() || std::any_of(criteria.begin(), criteria.end(), [&tags](const ReadPolicy::TagSet& set) {
+            return std::all_of(set.begin(), set.end(), [&tags](const ReadPolicy::TagSet::value_type& kv) {
+                auto i = tags.find(kv.first);
+                return i != tags.end() && i->second == kv.second;
+            });
         });
-        
-        if (i != end()) {
-            lostPrimarySince_ = decltype(lostPrimarySince_)::max();
-            return i->get();
-        } else {
-            return 0;
-        }
-    }
-    
-    bool tagsMatch(const Backend* b, const bson::Array& criteria)
-    {
-        return criteria.empty() || tagsMatch(backendInfo(b).tags, criteria);
     }
     
-    bool tagsMatch(const bson::Object& tags, const bson::Array& criteria)
+    /// Returns backends which are healthy and satisfy `policy' in terms of tags
+    /// and replication lag, ordered by roundtrip. Computed once per policy
+    /// per `health' snapshot, so it only changes as pings arrive.
+    std::shared_ptr<const std::vector<Backend*> > eligible(const Health& health, const ReadPolicy& policy)
     {
-        return criteria.empty() || std::any_of(criteria.begin(), criteria.end(), [&tags](const bson::Element& tagEl) {
-            bson::Object tag = tagEl.as<bson::Object>();
-            return std::all_of(tag.begin(), tag.end(),
-                [&tags](const bson::Element& el) { return el == tags[el.name()]; });
-        });
+        std::shared_ptr<const CandidateCache> cache = std::atomic_load(&health.candidates);
+        if (cache) {
+            auto i = cache->find(policy.id());
+            if (i != cache->end())
+                return i->second;
+        }
+        
+        Optime optimeThreshold = policy.maxLag() != Optime::max() && health.maxOptime != Optime::max()
+            ? health.maxOptime - policy.maxLag()
+            : Optime(0);
+        
+        auto ret = std::make_shared<std::vector<Backend*> >();
+        auto byrt = byRoundtrip();
+        for (Backend* b: byrt.value()) {
+            const MemberHealth& m = health.member(b);
+            if (m.isHealthy() && tagsMatch(m.tags, policy.tags()) && m.optime >= optimeThreshold)
+                ret->push_back(b);
+        }
+        
+        if (policy.id()) {
+            // Should another reader publish its results first, ours are
+            // simply not cached; they will be found computed next time.
+            auto next = std::make_shared<CandidateCache>(cache ? *cache : CandidateCache());
+            next->insert(std::make_pair(policy.id(), ret));
+            std::atomic_compare_exchange_strong(&health.candidates, &cache, std::shared_ptr<const CandidateCache>(std::move(next)));
+        }
+        return ret;
     }
 
-    static bool isPrimary(const Backend* b) { return b->alive() && b->status()["status"]["myState"].as<int>(0) == 1; }
-
-    static bool isHealthy(const Backend* b)
-    {
-        if (!b->alive())
-            return false;
-        int status = b->status()["status"]["myState"].as<int>(0);
-        return status == 1 || status == 2;
-    }
-    
-    BackendInfo backendInfo(const Backend* b) const
-    {
-        auto lock = sharedLock();
-        auto i = backendInfo_.find(b);
-        return i != backendInfo_.end() ? i->second : BackendInfo();
-    }
-    
-    std::map<const Backend*, BackendInfo> backendInfo() const
-    {
-        auto lock = sharedLock();
-        return backendInfo_;
-    }
-    
-    Optime maxOptime(const BackendInfoMap& info) const
-    {
-        auto i = std::max_element(
-            info.begin(), info.end(),
-            [](const BackendInfoMap::value_type& a, const BackendInfoMap::value_type& b) {
-                return a.second.optime < b.second.optime;
-            }
-        );
-        return (i != info.end()) ? i->second.optime : Optime::max();
-    }
-    
     void pingNow()
     {
         if (ping_.completed())
@@ -499,10 +754,9 @@ private /*methods*/:
     
 private /*fields*/:
     std::string name_;
-    mutable io::sys::shared_mutex mutex_;
-    Lazy<Backend*> primary_;
-    std::map<const Backend*, BackendInfo> backendInfo_;
-    SteadyClock::time_point lostPrimarySince_;
+    std::shared_ptr<const Health> health_; // accessed atomically
+    io::sys::mutex updateMutex_;           // serializes writers of `health_'
+    std::atomic<SteadyClock::time_point> lostPrimarySince_;
     mutable io::task<void> ping_;
 };
 
@@ -513,10 +767,10 @@ public:
         Multiple({}, addrs)
     {}
     
-    Connection readOp(const uint32_t /*queryFlags*/, const bson::Object& /*readPreference*/, Backend* exclude)
+    Connection readOp(const ReadPolicy& /*policy*/, const Backends& exclude, bool wait) override
     {
-        Backend* b = selectLocal([exclude](const Backend* b) { return b != exclude; });
-        return b ? b->endpoint()->getAny() : Connection();
+        Backend* b = selectLocal([&exclude](const Backend* b) { return !excluded(b, exclude); });
+        return b ? b->endpoint()->getAny(wait) : Connection();
     }
 };
 
@@ -31,8 +31,44 @@
 #include "backend.h"
 #include "monitor.h"
 #include "proto.h"
+#include "readpref.h"
 #include <map>
 #include <memory>
+#include <atomic>
+
+/// A token bucket limiting retransmits of requests to a shard to
+/// `--retransmit-budget' percent of requests (plus one per second).
+class RetransmitBudget {
+public:
+    RetransmitBudget(): tokens_(BURST), refilledAt_(SteadyClock::now()) {}
+    
+    /// Called for each request which might be retransmitted.
+    void requested();
+    
+    /// Returns true if a retransmit is allowed, consuming a token.
+    bool tryRetransmit();
+    
+    /// Called when a retransmitted request completes first.
+    void won() { ++won_; }
+    
+    struct Stats {
+        uint64_t sent;
+        uint64_t won;
+        uint64_t suppressed;
+    };
+    Stats stats() const { return Stats { sent_, won_, suppressed_ }; }
+    
+private /*fields*/:
+    static constexpr double BURST = 10;
+    
+    io::sys::mutex mutex_;
+    double tokens_;
+    SteadyClock::time_point refilledAt_;
+    std::atomic<uint64_t> sent_ { 0 };
+    std::atomic<uint64_t> won_ { 0 };
+    std::atomic<uint64_t> suppressed_ { 0 };
+};
+
 
 class Shard: public std::enable_shared_from_this<Shard> {
 public:
@@ -52,29 +88,43 @@ public:
     
     bool supportsWriteCommands() const { return softwareVersion() >= Backend::SoftwareVersion { 2,6,0 }; }
     
-    /// Returns a connection suitable for read operation with specified `flags'
-    /// (taken directly from OP_QUERY message) and `readPreference',
-    /// referencing a backend different from `exclude' (if specified).
-    /// May return NULL if no suitable backend found.
-    virtual Connection readOp(
-        uint32_t queryFlags,
-        const bson::Object& readPreference,
-        Backend* exclude = 0
-    ) = 0;
+    typedef std::vector<const Backend*> Backends;
+    
+    /// Returns a connection suitable for read operation with specified read `policy',
+    /// referencing a backend not listed in `exclude'. When `exclude' is not empty
+    /// (i.e. the request is being retransmitted), backends differing from
+    /// the excluded ones in `--hedge-spread-tag' are preferred.
+    /// May return NULL if no suitable backend found, or (unless `wait' is set)
+    /// if the connection pool of the selected backend is exhausted.
+    virtual Connection readOp(const ReadPolicy& policy, const Backends& exclude = Backends(), bool wait = true) = 0;
     
     virtual std::unique_ptr<WriteOperation> write(Namespace ns, ChunkVersion v, std::vector<char> msg);
     virtual std::unique_ptr<WriteOperation> write(Namespace ns, ChunkVersion v, bson::Object cmd);
+    
+    /// Performs a legacy write as a write command `cmd', keeping its result
+    /// for a later getLastError (requires supportsWriteCommands()).
+    virtual std::unique_ptr<WriteOperation> writeLegacy(Namespace ns, ChunkVersion v, bson::Object cmd);
 
     /// Returns a connection suitable for write operations.
     /// Used in default implementation of write().
     virtual Connection primary() { return Connection(); }
     
+    /// Same as above, but if the shard has no primary, waits
+    /// for at most `timeout' for one to be elected.
+    Connection primary(io::timeout timeout);
+    
+    /// Incremented each time a new primary is discovered.
+    uint64_t primaryEpoch() const { return primaryEpoch_; }
+    
+    /// Waits for at most `timeout' for primaryEpoch() to differ from `seen'.
+    /// Returns false on timeout.
+    bool waitForPrimary(uint64_t seen, io::timeout timeout);
+    
     /// Called upon a failure while communicating with a backend.
-    void failed(Backend* b)
-    {
-        onFailure(b);
-        b->failed();
-    }
+    void failed(Backend* b);
+    
+    /// Called upon a successful request to a backend.
+    void succeeded(Backend* b);
     
     /// Called upon recevied `not a master' error from a node
     /// which was supposed to be a master (applies only to replica set)
@@ -99,6 +149,8 @@ public:
     
     bson::Object debugInspect() const;
     
+    RetransmitBudget& retransmitBudget() { return retransmitBudget_; }
+    
     /// Parses `connstr' and constructs a shard of neccessary type.
     static std::unique_ptr<Shard> make(const std::string& id, const std::string& connstr);
     
@@ -115,14 +167,27 @@ protected:
     std::vector< std::unique_ptr<Backend> >::const_iterator begin() const { return backends_.begin(); }
     std::vector< std::unique_ptr<Backend> >::const_iterator end()   const { return backends_.end();   }
     
+    /// Wakes up writers waiting for a primary.
+    void primaryChanged();
+    
 private /*methods*/:
     virtual void onFailure(Backend*) {}
     
+    /// Ejects `b' as an outlier, unless `--outlier-max-ejected' percent
+    /// of backends are already ejected.
+    void eject(Backend* b, const std::string& reason);
+    
 private /*fields*/:
     std::string id_;
     std::string connstr_;
     std::vector<PingQuery> pingQueries_;
     std::vector< std::unique_ptr<Backend> > backends_;
+    RetransmitBudget retransmitBudget_;
+    io::sys::mutex ejectMutex_;
+    
+    std::atomic<uint64_t> primaryEpoch_ { 0 }; // modified with `primaryMutex_' held
+    io::mutex primaryMutex_;
+    io::condition_variable primaryCond_;
 };
 
 
@@ -30,6 +30,7 @@
 #include <sstream>
 #include <typeinfo>
 #include <chrono>
+#include <random>
 #include <cxxabi.h>
 
 inline std::string demangledType(const std::type_info& ti)
@@ -84,6 +85,14 @@ inline T fromString(const std::string& str)
         throw std::runtime_error("cannot parse `" + str + "' as " + demangledType(typeid(T)));
 }
 
+/// Returns a random number in [0, n) from a per-thread generator
+/// (unlike rand(), does not contend for a global lock).
+inline size_t randomIndex(size_t n)
+{
+    static thread_local std::minstd_rand gen(std::random_device{}());
+    return std::uniform_int_distribution<size_t>(0, n - 1)(gen);
+}
+
 template<class T, class... Args>
 std::unique_ptr<T> make_unique(Args&&... args)
 {
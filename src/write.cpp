@@ -100,6 +100,52 @@ bson::Object validateAck(bson::Object ack)
     return ack;
 }
 
+bool isError(const bson::Element& err) { return err.exists() && !err.is<bson::Null>(); }
+
+/// Converts a write command reply into what getLastError
+/// would have returned after the corresponding legacy write.
+bson::Object legacyStatus(const bson::Object& reply)
+{
+    bson::Element err, code;
+    bool wtimeout = false;
+    bson::Array writeErrors = reply["writeErrors"].as<bson::Array>(bson::Array());
+    bson::Object wcError = reply["writeConcernError"].as<bson::Object>(bson::Object());
+    
+    if (reply["ok"].as<int>(0) != 1) {
+        err = reply["errmsg"];
+        code = reply["code"];
+    } else if (writeErrors.begin() != writeErrors.end()) {
+        bson::Object first = writeErrors.begin()->as<bson::Object>();
+        err = first["errmsg"];
+        code = first["code"];
+    } else if (!wcError.empty()) {
+        err = wcError["errmsg"];
+        code = wcError["code"];
+        wtimeout = wcError["errInfo"]["wtimeout"].as<bool>(false);
+    }
+    
+    bson::ObjectBuilder b;
+    b["ok"] = 1;
+    if (isError(err))
+        b["err"] = err;
+    else
+        b["err"] = bson::Null();
+    if (code.exists())
+        b["code"] = code;
+    b["n"] = reply["n"].as<int32_t>(0);
+    
+    bson::Array upserted = reply["upserted"].as<bson::Array>(bson::Array());
+    bool hasUpserted = (upserted.begin() != upserted.end());
+    if (reply["nModified"].exists()) // an update
+        b["updatedExisting"] = !hasUpserted && reply["n"].as<int32_t>(0) != 0;
+    if (hasUpserted)
+        b["upserted"] = upserted.begin()->as<bson::Object>()["_id"];
+    if (wtimeout)
+        b["wtimeout"] = true;
+    
+    return b.obj();
+}
+
 bson::Object defaultAckMerger(const std::vector<bson::Object>& rets)
 {
     bson::Element err;
@@ -167,6 +213,21 @@ bson::Object defaultAckMerger(const std::vector<bson::Object>& rets)
     return b.obj();
 }
 
+/// Returns true if a write has been refused because the node is not
+/// (or no longer) the primary. Legacy getLastError reports 10058; write
+/// commands, including legacy writes converted to them, report NotMaster
+/// (10107) or NotMasterNoSlaveOk (13435).
+bool isNotMaster(const bson::Object& result)
+{
+    if (!isError(result["err"]))
+        return false;
+    int code = result["code"].as<int>(0);
+    if (code == 10058 || code == 10107 || code == 13435)
+        return true;
+    bson::Element err = result["err"];
+    return err.is<std::string>() && err.as<std::string>().compare(0, 10, "not master") == 0;
+}
+
 } // namespace
 
 void WriteToBackend::perform()
@@ -177,26 +238,27 @@ void WriteToBackend::perform()
     
     for (size_t attempt = 0; !timeout.expired(); ++attempt) {
         
-        c_ = vs_.shard->primary();
-        if (!c_.exists()) {
-            io::sleep(500_ms);
+        c_ = vs_.shard->primary(timeout);
+        if (!c_.exists())
             continue;
-        }
         
         io::task<bson::Object> t = io::spawn([this]{ return doPerform(c_); });
         io::wait(t, std::min(options().writeRetransmit, options().writeTimeout));
         
         if (t.completed()) {
             bson::Object result = t.join();
-            if (
-                !result["err"].exists() || result["err"].is<bson::Null>()
-                || result["code"].as<int>(0) != 10058 /* not master */
-            )
+            if (!isNotMaster(result)) {
+                if (!pinsConnection())
+                    c_.release();
                 return;
+            }
         
+            // The node may still be stepping down, so unless a new primary
+            // is seen soon, retry it once in a while.
+            uint64_t epoch = vs_.shard->primaryEpoch();
             vs_.shard->lostMaster();
             if (attempt != 0)
-                io::sleep(500_ms);
+                vs_.shard->waitForPrimary(epoch, std::min(timeout, io::timeout(500_ms)));
         } else {
             WARN() << "timeout while writing to " << c_.backend().addr();
             t.cancel();
@@ -253,6 +315,75 @@ bson::Object WriteToBackend26::doAcknowledge(Connection&, const bson::Object&)
 }
 
 
+WriteLegacyAsCommand::WriteLegacyAsCommand(Config::VersionedShard vs, Namespace ns, bson::Object cmd):
+    WriteToBackend(std::move(vs), std::move(ns)), cmd_(std::move(cmd))
+{}
+
+bson::Object WriteLegacyAsCommand::doPerform(Connection& c)
+{
+    DEBUG(1) << "Issuing legacy write as a write command to " << c.backend().addr();
+    c.establish(ns(), version(), QueryComposer(Namespace(ns().db(), "$cmd"), cmd_));
+    reply_ = readReply(c.stream(), 0);
+    status_ = legacyStatus(reply_);
+    return setAcknowledge(bson::object("getLastError", 1), status_);
+}
+
+bson::Object WriteLegacyAsCommand::doAcknowledge(Connection&, const bson::Object& writeConcern)
+{
+    if (isError(status_["err"]))
+        return status_;
+    
+    // The connection the write went through is gone, so make getLastError
+    // wait for the write's optime explicitly (available since mongod 2.6).
+    // Master-slave and pv0 replica sets report `lastOp' (a timestamp),
+    // pv1 replica sets report `opTime' ({ ts, t }).
+    bson::ObjectBuilder cmd;
+    for (const bson::Element& elt: writeConcern)
+        cmd[elt.name()] = elt;
+    bson::Element opTime = reply_["lastOp"].exists() ? reply_["lastOp"] : reply_["opTime"];
+    if (opTime.exists())
+        cmd["wOpTime"] = opTime;
+    if (reply_["electionId"].exists())
+        cmd["wElectionId"] = reply_["electionId"];
+    
+    // Without an optime, getLastError over another connection would not wait
+    // for anything, falsely reporting replication of the write.
+    bson::Element w = writeConcern["w"];
+    bool primaryOnly = !w.exists() || (w.canBe<double>() && w.as<double>() <= 1);
+    if (!opTime.exists() && !primaryOnly) {
+        bson::ObjectBuilder b;
+        for (const bson::Element& elt: status_)
+            if (strcmp(elt.name(), "err") && strcmp(elt.name(), "code"))
+                b[elt.name()] = elt;
+        b["err"] = "cannot determine optime of the write to wait for its replication";
+        return b.obj();
+    }
+    
+    Connection c = shard()->primary();
+    if (!c.exists())
+        throw errors::NoSuitableBackend("cannot communicate with primary for shard " + shard()->connectionString());
+    
+    c.establish(ns(), version(), QueryComposer(Namespace(ns().db(), "$cmd"), cmd.obj()).batchSize(1));
+    bson::Object gle = readReply(c.stream(), 0);
+    c.release();
+    
+    bson::Element err = (gle["ok"].as<int>(0) != 1) ? gle["errmsg"] : gle["err"];
+    bson::ObjectBuilder b;
+    for (const bson::Element& elt: status_)
+        if (!isError(err) || (strcmp(elt.name(), "err") && strcmp(elt.name(), "code")))
+            b[elt.name()] = elt;
+    if (isError(err)) {
+        b["err"] = err;
+        if (gle["code"].exists())
+            b["code"] = gle["code"];
+    }
+    for (const char* key: { "wtimeout", "waited", "wtime", "writtenTo", "wnote" })
+        if (gle[key].exists())
+            b[key] = gle[key];
+    return b.obj();
+}
+
+
 WriteFindAndModify::WriteFindAndModify(Config::VersionedShard vs, Namespace ns, bson::Object cmd):
     WriteToBackend(std::move(vs), std::move(ns)), cmd_(std::move(cmd))
 {}
@@ -350,6 +481,22 @@ std::unique_ptr<WriteOperation> upcast(std::unique_ptr<Op>& op)
 
 template<class Op> struct WriteOpTraits {};
 
+/// Finishes up a write command `b' and wraps it into a write operation.
+/// Legacy writes (which come with no write concern) are performed as
+/// write commands too, so they don't need to hold a connection until getLastError.
+std::unique_ptr<WriteOperation> writeCommand(
+    Config::VersionedShard vs, const Namespace& ns,
+    bson::ObjectBuilder& b, const bson::Object& writeConcern
+){
+    if (writeConcern.empty()) {
+        b["writeConcern"] = bson::object("w", 1);
+        return vs.shard->writeLegacy(ns, vs.version, b.obj());
+    } else {
+        b["writeConcern"] = writeConcern;
+        return vs.shard->write(ns, vs.version, b.obj());
+    }
+}
+
 template<class Op, class Self> struct WriteOpTraitsBase {
 
     /// Constructs a write operation which dispatches all its sub-operations (`subops')
@@ -359,7 +506,7 @@ template<class Op, class Self> struct WriteOpTraitsBase {
         const std::vector<typename Op::Subop> subops,
         const bson::Object& writeConcern
     ){
-        if (vs.shard->supportsWriteCommands() && !writeConcern.empty()) {
+        if (vs.shard->supportsWriteCommands()) {
             return make26(std::move(vs), ns, subops.data(), subops.size(), writeConcern);
         } else if (subops.size() == 1) {
             return Self::make24(std::move(vs), ns, subops.front());
@@ -382,7 +529,7 @@ template<class Op, class Self> struct WriteOpTraitsBase {
             throw errors::NotImplemented("Limit greater than one is not implemented");
 
         auto makeSingle = [&ns, &subop, &writeConcern](Config::VersionedShard vs) -> std::unique_ptr<WriteOperation> {
-            if (vs.shard->supportsWriteCommands() && !writeConcern.empty())
+            if (vs.shard->supportsWriteCommands())
                 return make26(std::move(vs), ns, &subop, 1, writeConcern);
             else
                 return Self::make24(std::move(vs), ns, subop);
@@ -419,8 +566,7 @@ private:
         b[Self::cmdName()] = ns.collection();
         b[Self::subopsKey()] = subs.array();
         b["ordered"] = false;
-        b["writeConcern"] = writeConcern;
-        return vs.shard->write(ns, vs.version, b.obj());
+        return writeCommand(std::move(vs), ns, b, writeConcern);
     }
 
     static std::unique_ptr<WriteOperation> make24(
@@ -448,7 +594,7 @@ public:
         Config::VersionedShard vs, const Namespace& ns,
         const std::vector<bson::Object>& docs, const bson::Object& writeConcern
     ){
-        if (vs.shard->supportsWriteCommands() && !writeConcern.empty()) {
+        if (vs.shard->supportsWriteCommands()) {
             
             bson::ArrayBuilder docsArray;
             for (const bson::Object& doc: docs)
@@ -458,8 +604,7 @@ public:
             b["insert"] = ns.collection();
             b["documents"] = docsArray.array();
             b["ordered"] = false;
-            b["writeConcern"] = writeConcern;
-            return vs.shard->write(ns, vs.version, b.obj());
+            return writeCommand(std::move(vs), ns, b, writeConcern);
             
         } else {
             
@@ -43,6 +43,7 @@ public:
     bson::Object doAcknowledge(const bson::Object& writeConcern) override { return doAcknowledge(c_, writeConcern); }
     
 protected:
+    const std::shared_ptr<Shard>& shard() const { return vs_.shard; }
     const Namespace& ns() const { return ns_; }
     const ChunkVersion& version() const { return vs_.version; }
     
@@ -50,6 +51,10 @@ private /*methods*/:
     virtual bson::Object doPerform(Connection& c) = 0;
     virtual bson::Object doAcknowledge(Connection& c, const bson::Object& writeConcern) = 0;
     
+    /// Whether the connection is to be held until finish() rather than
+    /// released right after the operation is performed.
+    virtual bool pinsConnection() const { return false; }
+    
 private /*fields*/:
     Config::VersionedShard vs_;
     Namespace ns_;
@@ -64,10 +69,32 @@ public:
     bson::Object doPerform(Connection& c) override;
     bson::Object doAcknowledge(Connection& c, const bson::Object& writeConcern) override;
     
+    /// getLastError must be issued over the same connection
+    bool pinsConnection() const override { return true; }
+    
 private:
     std::vector<char> msg_;
 };
 
+/// A legacy write operation (OP_INSERT, OP_UPDATE or OP_DELETE) performed
+/// as a write command with `{w: 1}' write concern. Its result is kept in
+/// getLastError format, so the connection is not needed afterwards;
+/// getLastError with a stronger write concern is issued over any connection
+/// to the primary and waits for the write's optime.
+class WriteLegacyAsCommand: public WriteToBackend {
+public:
+    WriteLegacyAsCommand(Config::VersionedShard vs, Namespace ns, bson::Object cmd);
+    
+    bool isAcknowledgable() const override { return true; }
+    bson::Object doPerform(Connection& c) override;
+    bson::Object doAcknowledge(Connection& c, const bson::Object& writeConcern) override;
+    
+private:
+    bson::Object cmd_;
+    bson::Object reply_;
+    bson::Object status_;
+};
+
 class WriteToBackend26: public WriteToBackend {
 public:
     WriteToBackend26(Config::VersionedShard vs, Namespace ns, bson::Object cmd);